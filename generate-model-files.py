@@ -1,25 +1,691 @@
 #!/usr/bin/env python3
 
 import mmap
+import math
 import struct
 import os
 import argparse
+import zlib
+from array import array
+
+# weights_format in config.bin, must match WEIGHTS_* in transformer64.h
+WEIGHTS_F32 = 0
+WEIGHTS_Q8 = 1
+WEIGHTS_BF16 = 2
+WEIGHTS_LNS = 3
+WEIGHTS_Q4 = 4
+WEIGHTS_FORMATS = { "f32": WEIGHTS_F32, "q8": WEIGHTS_Q8, "bf16": WEIGHTS_BF16, "lns": WEIGHTS_LNS, "q4": WEIGHTS_Q4 }
+
+# ffn_layout in config.bin, must match FFN_* in transformer64.h
+FFN_SEPARATE = 0
+FFN_INTERLEAVED = 1
+FFN_LAYOUTS = { "separate": FFN_SEPARATE, "interleaved": FFN_INTERLEAVED }
+
+# kv_format in config.bin, must match KV_* in transformer64.h
+KV_F32 = 0
+KV_Q8 = 1
+KV_FORMATS = { "f32": KV_F32, "q8": KV_Q8 }
+
+# the vocabulary stays in C64 RAM: tokenizer.bin is compiled in, and every token takes 16 bytes more at run time
+# (vocab and sorted vocab pointers, logits, sampler probindex and the shortlist), about 14KB for stories260K
+VOCAB_RAM_PER_TOKEN = 16
+VOCAB_RAM = 16 * 1024
+
+_F32 = struct.Struct('f')
+
+def f32(v):
+    # round to float32 like every float operation on C64 does
+    return _F32.unpack(_F32.pack(v))[0]
+
+def quantize_row(row, gs):
+    # int8 values and one float scale per group of gs weights
+    q = array('b')
+    scales = array('f')
+    for g in range(0, len(row), gs):
+        group = row[g:g + gs]
+        scale = max(abs(v) for v in group) / 127.0
+        scales.append(scale)
+        for v in group:
+            q.append(int(round(v / scale)) if scale != 0.0 else 0)
+    return q, scales
+
+def q4_row(row, gs):
+    # values -7..7 and one float scale per group of gs weights, like quantize_row()
+    q = array('b')
+    scales = array('f')
+    for g in range(0, len(row), gs):
+        group = row[g:g + gs]
+        scale = max(abs(v) for v in group) / 7.0
+        scales.append(scale)
+        for v in group:
+            q.append(int(round(v / scale)) if scale != 0.0 else 0)
+    return q, scales
+
+def q4_pack(q, gs):
+    # two values in a byte, value j of a group in the low nibble and value j + len/2 in the high one,
+    # so that q4_unpack() in nnet64.c gets both halves of the group with the same index
+    packed = array('B')
+    for g in range(0, len(q), gs):
+        group = q[g:g + gs]
+        h = len(group) // 2
+        packed.extend((group[j] & 15) | ((group[j + h] & 15) << 4) for j in range(h))
+    return packed
+
+def bf16_row(row):
+    # upper halves of the float32 values, rounded to nearest even
+    bits = array('I', array('f', row).tobytes())
+    return array('H', [(b + 0x7fff + ((b >> 16) & 1)) >> 16 for b in bits])
+
+def bf16_floats(h):
+    # the float32 values C64 gets back from bfloat16
+    return array('f', array('I', [v << 16 for v in h]).tobytes())
+
+def lns_tables():
+    # lns_init() in nnet64.c: antilog table, 16*log2 of the top mantissa bits, 2^(k/16)
+    exp = HostModel.my_exp_poly
+    table = [int(f32(f32(16384.0 * exp(f32(m * f32(-0.69314718056 / 16.0)))) + 0.5)) for m in range(255)] + [0]
+    frac = [exp(f32(k * f32(0.69314718056 / 16.0))) for k in range(16)]
+    log = []
+    l = 0
+    for m in range(128):
+        while l < 16 and 1.0 + m / 128.0 >= exp(f32((l + 0.5) * f32(0.69314718056 / 16.0))):
+            l += 1
+        log.append(l)
+    return table, log, frac
+
+def lns_row(row, gs, table):
+    # sign (bit 7) and the code m of the nearest s * table[m] for every weight, one float scale s per group
+    codes = array('B')
+    scales = array('f')
+    for g in range(0, len(row), gs):
+        group = row[g:g + gs]
+        scale = f32(max(abs(v) for v in group) / 16384.0)
+        scales.append(scale)
+        for v in group:
+            target = abs(v) / scale if scale != 0.0 else 0.0
+            m = min(127, max(0, round(-16.0 * math.log2(target / 16384.0)))) if target > 0.0 else 127
+            m = min((c for c in (m - 1, m, m + 1) if 0 <= c <= 127), key=lambda c: abs(table[c] - target))
+            codes.append(m | (0x80 if v < 0.0 else 0))
+    return codes, scales
+
+def rope_row(pos, head_size):
+    # cos/sin pairs of the RoPE angles at pos for one head, in float32 like llama2.c run.c computes them
+    row = []
+    for i in range(0, head_size, 2):
+        freq = f32(1.0 / f32(10000.0 ** f32(i / head_size)))
+        val = f32(pos * freq)
+        row += [f32(math.cos(val)), f32(math.sin(val))]
+    return row
+
+def rope_coarse_rows(config):
+    # streaming mode goes past seq_len, rope_table() in nnet64.c rotates the row of pos % seq_len
+    # by the row of the multiple of seq_len below pos, for every pos up to 65535
+    return 65535 // config.seq_len + 1 if config.kv_window > 0 else 0
+
+LOG2E = struct.unpack('<f', struct.pack('<I', 0x3FB8AA3B))[0]
+
+class HostModel:
+    # float32 forward pass on the host, operation by operation like nnet64.c and math.c do it on C64,
+    # so that the states precomputed here are the ones C64 would get
+    LAYERED = ("rms_att_weight", "wq", "wk", "wv", "wo", "rms_ffn_weight", "w1", "w2", "w3")
+
+    def __init__(self, weights, config):
+        self.config = config
+        self.data, self.tensors = weights.tensor_data(config)
+        self.gs = config.group_size
+        self.quantized = config.weights_format in (WEIGHTS_Q8, WEIGHTS_Q4) # int8 x for both
+        self.lns = config.weights_format == WEIGHTS_LNS
+        if self.lns:
+            self.lns_table, self.lns_log, self.lns_frac = lns_tables()
+        self.kv_quantized = config.kv_format == KV_Q8
+        self.ffn_epsilon = f32(config.ffn_epsilon)
+        self.exp_table = config.exp_table
+        if self.exp_table:
+            # exp_table_init() in math.c
+            self.exp_hi = [self.my_exp_poly(f32(i * f32(0.69314718056 / 256.0))) for i in range(256)]
+            self.exp_lo = [self.my_exp_poly(f32(i * f32(0.69314718056 / 65536.0))) for i in range(256)]
+        self.fixed = config.fixed_point
+        if self.fixed:
+            # sigmoid_table_init() in math.c, after the exp tables
+            self.sigmoid_q15 = [int(f32(f32(32768.0 / f32(1.0 + self.my_exp(f32(8.0 - t * 0.0625)))) + 0.5)) for t in range(257)]
+            self.ffn_epsilon = int(f32(self.ffn_epsilon * 65536.0))
+        self.head_size = config.dim // config.n_heads
+        self.kv_dim = config.dim * config.n_kv_heads // config.n_heads
+        self.rows_cache = {}
+
+    def rows(self, name, layer=0):
+        # rows of a tensor (of one layer), int8 with scales for quantized weights like in the REU image
+        if (name, layer) not in self.rows_cache:
+            offset, rows, cols, quantize = self.tensors[name]
+            if name in self.LAYERED:
+                rows //= self.config.n_layers
+                offset += layer * rows * cols
+            r = [self.data[offset + i * cols:offset + (i + 1) * cols] for i in range(rows)]
+            if self.config.weights_format == WEIGHTS_Q4 and quantize:
+                r = [q4_row(row, self.gs) for row in r]
+            elif self.quantized and quantize:
+                r = [quantize_row(row, self.gs) for row in r]
+            elif self.config.weights_format == WEIGHTS_BF16 and quantize:
+                r = [bf16_floats(bf16_row(row)) for row in r]
+            elif self.lns and quantize:
+                r = [lns_row(row, self.gs, self.lns_table) for row in r]
+            self.rows_cache[(name, layer)] = r
+        return self.rows_cache[(name, layer)]
+
+    @staticmethod
+    def quantize_group(x):
+        # quantize_group() in nnet64.c
+        scale = f32(max(abs(v) for v in x) / 127.0)
+        iscale = f32(1.0 / scale) if scale != 0.0 else 0.0
+        xq = []
+        for v in x:
+            val = f32(v * iscale)
+            xq.append(int(f32(val - 0.5)) if val < 0.0 else int(f32(val + 0.5)))
+        return xq, scale
+
+    def lns_log2(self, v):
+        # lns_log2() in nnet64.c
+        bits = struct.unpack('<I', struct.pack('<f', v))[0]
+        e = (bits >> 23) & 0xff
+        return (e << 4) + self.lns_log[(bits >> 16) & 0x7f] if e else 0
+
+    def lns_prepare(self, x):
+        # lns_prepare_x() in nnet64.c, codes, signs and scales
+        xm, xg, xs = [], [], []
+        for g in range(0, len(x), self.gs):
+            group = x[g:g + self.gs]
+            logs = [self.lns_log2(v) for v in group]
+            lmax = max(logs)
+            xm += [255 if l == 0 or lmax - l > 127 else lmax - l for l in logs]
+            xg += [0x80 if math.copysign(1.0, v) < 0 else 0 for v in group]
+            bits = struct.unpack('<I', struct.pack('<f', self.lns_frac[lmax & 15]))[0]
+            bits = (bits & 0x807fffff) | ((lmax >> 4) << 23)
+            xs.append(struct.unpack('<f', struct.pack('<I', bits))[0] if lmax else 0.0)
+        return xm, xg, xs
+
+    def prepare(self, x):
+        # matmul_prepare() in nnet64.c, quantize_x() for int8 weights
+        if self.lns:
+            return self.lns_prepare(x)
+        if not self.quantized:
+            return x
+        xq = []
+        xs = []
+        for g in range(0, len(x), self.gs):
+            q, scale = self.quantize_group(x[g:g + self.gs])
+            xq += q
+            xs.append(scale)
+        return xq, xs
+
+    def dot(self, w, x):
+        # fdot(), q8_dot(), q4_dot() or lns_dot() in nnet64.c, x from prepare(); rows in tiles
+        # give the same results, the sum of a tile goes on from that of the previous one
+        val = 0.0
+        if self.lns:
+            gs, table = self.gs, self.lns_table
+            (wc, ws), (xm, xg, xs) = w, x
+            for g in range(len(ws)):
+                ival = 0
+                for j in range(g * gs, min((g + 1) * gs, len(wc))):
+                    c = (wc[j] & 0x7f) + xm[j]
+                    if c < 256:
+                        ival += -table[c] if (wc[j] ^ xg[j]) & 0x80 else table[c]
+                val = f32(val + f32(f32(ival * ws[g]) * xs[g]))
+            return val
+        if not self.quantized:
+            for a, b in zip(w, x):
+                val = f32(val + f32(a * b))
+            return val
+        gs = self.gs
+        (wq, ws), (xq, xs) = w, x
+        for g in range(len(ws)):
+            ival = sum(a * b for a, b in zip(wq[g * gs:(g + 1) * gs], xq[g * gs:(g + 1) * gs]))
+            val = f32(val + f32(f32(ival * ws[g]) * xs[g]))
+        return val
+
+    def matmul(self, x, rows):
+        xp = self.prepare(x)
+        return [self.dot(w, xp) for w in rows]
+
+    def embed(self, token):
+        row = self.rows("token_embedding_table")[token]
+        if self.lns:
+            wc, ws = row
+            row = [f32(self.lns_table[c & 0x7f] * ws[j // self.gs]) * (-1.0 if c & 0x80 else 1.0) for j, c in enumerate(wc)]
+        elif self.quantized:
+            wq, ws = row
+            row = [f32(wq[j] * ws[j // self.gs]) for j in range(self.config.dim)]
+        return self.acts_from_floats(row)
+
+    # activations, Q15.16 ints with --fixed-point, see the activations section in nnet64.c
+
+    @staticmethod
+    def act_from_float(f):
+        bits = struct.unpack('<I', struct.pack('<f', f))[0]
+        e = (bits >> 23) & 0xff
+        if e < 127 - 17:
+            return 0
+        if e >= 127 + 15:
+            m = 0x7fffffff
+        else:
+            m = (bits & 0x7fffff) | 0x800000
+            sh = 134 - e
+            m = (m + (1 << (sh - 1))) >> sh if sh > 0 else m << -sh
+        return -m if bits & 0x80000000 else m
+
+    @staticmethod
+    def fix_float(v, e):
+        # truncated to 24 bits
+        m = abs(v)
+        while m >= 1 << 24:
+            m >>= 1
+            e += 1
+        return math.copysign(math.ldexp(m, e), v) if v else 0.0
+
+    @staticmethod
+    def act_mul(a, b):
+        sh = 0
+        while a >= 0x8000 or a < -0x8000:
+            a >>= 1
+            sh += 1
+        while b >= 0x8000 or b < -0x8000:
+            b >>= 1
+            sh += 1
+        p = a * b
+        return p << (sh - 16) if sh >= 16 else p >> (16 - sh)
+
+    def acts_from_floats(self, x):
+        return [self.act_from_float(v) for v in x] if self.fixed else list(x)
+
+    def acts_to_floats(self, x):
+        return [self.fix_float(v, -16) for v in x] if self.fixed else x
+
+    def act_add(self, x, y):
+        if self.fixed:
+            return [a + self.act_from_float(b) for a, b in zip(x, y)]
+        return [f32(a + b) for a, b in zip(x, y)]
+
+    def rmsnorm(self, x, gain):
+        if self.fixed:
+            return self.rmsnorm_fixed(x, gain)
+        ss = 0.0
+        for v in x:
+            ss = f32(ss + f32(v * v))
+        ss = f32(ss / len(x))
+        ss = f32(ss + f32(0.00001))
+        ss = f32(1.0 / f32(math.sqrt(ss)))
+        if self.config.fold_weights:
+            return [f32(ss * v) for v in x]
+        return [f32(f32(g * ss) * v) for g, v in zip(gain, x)]
+
+    def rmsnorm_fixed(self, x, gain):
+        amax = max(abs(v) for v in x)
+        k = 0
+        while amax >= 0x8000:
+            amax >>= 1
+            k += 1
+        # RMS_SHIFT of nnet64.c, the sum of squares stays within 32 bits
+        shift = 4
+        while len(x) > 2 ** (2 * shift + 1):
+            shift += 1
+        ss = sum((v >> (k + shift)) ** 2 for v in x)
+        r = f32(self.fix_float(ss, 2 * (k + shift) - 32) / len(x))
+        r = f32(r + f32(0.00001))
+        r = f32(1.0 / f32(math.sqrt(r)))
+        bits = struct.unpack('<I', struct.pack('<f', r))[0]
+        rm = ((bits & 0x7fffff) | 0x800000) >> 9
+        sh = 141 - (bits >> 23) - k
+        o = [((v >> k) * rm) >> sh if sh >= 0 else ((v >> k) * rm) << -sh for v in x]
+        if not self.config.fold_weights:
+            o = [self.act_mul(v, self.act_from_float(g)) for g, v in zip(gain, o)]
+        return o
+
+    def swiglu(self, h1, h3):
+        # swiglu() in nnet64.c
+        if not self.fixed:
+            h1 = f32(h1 * f32(1.0 / f32(1.0 + self.my_exp(f32(-h1)))))
+            h = f32(h1 * h3)
+            return 0.0 if abs(h) < self.ffn_epsilon else h
+        h1 = self.act_from_float(h1)
+        if h1 <= -8 * 65536:
+            return 0
+        sig = 65536
+        if h1 < 8 * 65536:
+            t = h1 + 8 * 65536
+            i, f = t >> 12, (t >> 4) & 0xff
+            s0 = self.sigmoid_q15[i]
+            sig = (s0 << 1) + (((self.sigmoid_q15[i + 1] - s0) * f) >> 7)
+        h = self.act_mul(self.act_mul(h1, sig), self.act_from_float(h3))
+        return 0 if -self.ffn_epsilon < h < self.ffn_epsilon else h
+
+    @staticmethod
+    def my_exp_poly(f):
+        f = f32(f * LOG2E)
+        ff = math.floor(f)
+        g = f32(f - ff)
+        fi = int(ff)
+        if fi < -126:
+            return 0.0
+        # upper half of the float from a 16-bit int, like on C64
+        x = struct.unpack('<f', struct.pack('<HH', 0, ((fi + 0x7f) << 7) & 0xffff))[0]
+        s = f32(2.1498763701e-5)
+        for c in (1.4352314037e-4, 1.3422634825e-3, 9.6140170135e-3, 5.5505126860e-2, 0.24022638460, 0.69314718618, 1.0):
+            s = f32(f32(s * g) + f32(c))
+        return f32(s * x)
+
+    def my_exp(self, f):
+        if not self.exp_table:
+            return self.my_exp_poly(f)
+        # my_exp_table() in math.c
+        if f < -44.0:
+            return 0.0
+        f = min(f, 44.0)
+        m = struct.unpack('<I', struct.pack('<f', f32(f32(f * f32(LOG2E * 65536.0)) + 12582912.0)))[0]
+        e = ((m >> 16) & 0x7f) - 64
+        x = f32(self.exp_hi[(m >> 8) & 0xff] * self.exp_lo[m & 0xff])
+        return f32(x * 2.0 ** e)
+
+    def rope(self, vec, pos):
+        fcir = rope_row(pos, self.head_size)
+        for i in range(0, len(vec), 2):
+            fcr, fci = fcir[i % self.head_size], fcir[i % self.head_size + 1]
+            v0, v1 = vec[i], vec[i + 1]
+            vec[i] = f32(f32(v0 * fcr) - f32(v1 * fci))
+            vec[i + 1] = f32(f32(v0 * fci) + f32(v1 * fcr))
+
+    def kv_entry(self, x):
+        # a key or value vector as kv_store() puts it into the kv cache: per head, floats or (int8, scale)
+        hs = self.head_size
+        heads = [x[h:h + hs] for h in range(0, len(x), hs)]
+        return [self.quantize_group(v) for v in heads] if self.kv_quantized else heads
+
+    def kv_bytes(self, entry):
+        if self.kv_quantized:
+            return b"".join(array('b', q).tobytes() + struct.pack('f', scale) for q, scale in entry)
+        return b"".join(array('f', v).tobytes() for v in entry)
+
+    def attn(self, q, keys, values):
+        # attn() in nnet64.c, grouped by kv heads with online softmax
+        hs = self.head_size
+        kv_mul = self.config.n_heads // self.config.n_kv_heads
+        head_sqrt = f32(math.sqrt(hs))
+        xb = []
+        for g in range(self.config.n_kv_heads):
+            qh = [q[(g * kv_mul + j) * hs:(g * kv_mul + j + 1) * hs] for j in range(kv_mul)]
+            if self.kv_quantized:
+                qh = [self.quantize_group(v) for v in qh]
+            out = [[0.0] * hs for j in range(kv_mul)]
+            max_val = [0.0] * kv_mul
+            total = [0.0] * kv_mul
+            att = [0.0] * kv_mul
+            for t in range(len(keys)):
+                k = keys[t][g]
+                for j in range(kv_mul):
+                    if self.kv_quantized:
+                        (kq, ks), (hq, qs) = k, qh[j]
+                        score = f32(f32(float(sum(a * b for a, b in zip(kq, hq))) * ks) * qs)
+                    else:
+                        score = 0.0
+                        for a, b in zip(k, qh[j]):
+                            score = f32(score + f32(a * b))
+                    if not self.config.fold_weights:
+                        score = f32(score / head_sqrt)
+                    if t == 0 or score > max_val[j]:
+                        if t > 0:
+                            c = self.my_exp(f32(max_val[j] - score))
+                            total[j] = f32(total[j] * c)
+                            out[j] = [f32(v * c) for v in out[j]]
+                        else:
+                            total[j] = 0.0
+                        max_val[j] = score
+                        a = 1.0
+                    else:
+                        a = self.my_exp(f32(score - max_val[j]))
+                    total[j] = f32(total[j] + a)
+                    att[j] = a
+                v = values[t][g]
+                for j in range(kv_mul):
+                    if self.kv_quantized:
+                        vq, vs = v
+                        a = f32(att[j] * vs)
+                    else:
+                        vq, a = v, att[j]
+                    out[j] = [f32(o + f32(a * b)) for o, b in zip(out[j], vq)]
+            for j in range(kv_mul):
+                xb += [f32(v / total[j]) for v in out[j]]
+        return xb
+
+    def forward(self, token, cache):
+        # forward() in nnet64.c without the classifier, cache holds (keys, values) per layer and grows by one position
+        config = self.config
+        pos = len(cache[0][0])
+        x = self.embed(token)
+        for l in range(config.n_layers):
+            gain = None if config.fold_weights else self.rows("rms_att_weight", l)[0]
+            xb = self.prepare(self.acts_to_floats(self.rmsnorm(x, gain)))
+            q = [self.dot(w, xb) for w in self.rows("wq", l)]
+            k = [self.dot(w, xb) for w in self.rows("wk", l)]
+            v = [self.dot(w, xb) for w in self.rows("wv", l)]
+            self.rope(q, pos)
+            self.rope(k, pos)
+            keys, values = cache[l]
+            keys.append(self.kv_entry(k))
+            values.append(self.kv_entry(v))
+            xb2 = self.matmul(self.attn(q, keys, values), self.rows("wo", l))
+            x = self.act_add(x, xb2)
+            gain = None if config.fold_weights else self.rows("rms_ffn_weight", l)[0]
+            xb = self.prepare(self.acts_to_floats(self.rmsnorm(x, gain)))
+            hb = [self.swiglu(self.dot(w1, xb), self.dot(w3, xb)) for w1, w3 in zip(self.rows("w1", l), self.rows("w3", l))]
+            xb = self.matmul(self.acts_to_floats(hb), self.rows("w2", l))
+            x = self.act_add(x, xb)
+        return x
 
 class Weights:
     def __init__(self):
         self.weights_data = None
+        self.tensors_cache = None
 
-    def read_weights(self, checkpoint, output_filename="weights.reu"):
+    def read_weights(self, checkpoint, config, output_filename="weights.reu"):
         with open(checkpoint, "rb") as file:
             file.seek(28)  # Skip the first 28 bytes (Config)
             self.weights_data = file.read()
 
         with open(output_filename, "wb") as file:
             file.write('L264'.encode('utf-8')) # signature magic - embedded in transformer64.c
-            file.write(self.weights_data)
+            self.write_rows(file, config)
+            if config.layer0_table:
+                self.write_layer0_table(file, config)
+            if config.cls_bound:
+                self.write_cls_bound(file, config)
+            if config.prefixes:
+                self.write_prefixes(file, config)
 
         self.pad_to_next_multiple(output_filename)
 
+    def tensors(self, config):
+        # (name, rows, columns, quantize) in checkpoint order, layers stacked as rows
+        head_size = config.dim // config.n_heads
+        kv_dim = config.dim * config.n_kv_heads // config.n_heads
+        layers = config.n_layers
+        t = [
+            ("token_embedding_table", config.vocab_size, config.dim, True),
+            ("rms_att_weight", layers, config.dim, False),
+            ("wq", layers * config.dim, config.dim, True),
+            ("wk", layers * kv_dim, config.dim, True),
+            ("wv", layers * kv_dim, config.dim, True),
+            ("wo", layers * config.dim, config.dim, True),
+            ("rms_ffn_weight", layers, config.dim, False),
+            ("w1", layers * config.hidden_dim, config.dim, True),
+            ("w2", layers * config.dim, config.hidden_dim, True),
+            ("w3", layers * config.hidden_dim, config.dim, True),
+            ("rms_final_weight", 1, config.dim, False),
+            ("freq_cis_real", config.seq_len, head_size // 2, False), # replaced by the rope table in REU image
+            ("freq_cis_imag", config.seq_len, head_size // 2, False),
+        ]
+        if not config.checkpoint_shared:
+            t.append(("wcls", config.vocab_size, config.dim, True))
+        return t
+
+    def rows(self, config):
+        # (row, quantize) for every row in REU image order
+        data, tensors = self.tensor_data(config)
+        order = [name for name, rows, cols, quantize in self.tensors(config)]
+        if "wcls" not in order and not config.shared_weights:
+            order.append("wcls")
+        if config.ffn_layout == FFN_INTERLEAVED:
+            # matching rows of w1 and w3 next to each other, in place of w1
+            order.remove("w3")
+        for name in order:
+            if name == "freq_cis_real":
+                # cos/sin pairs interleaved, one row of head_size floats per position
+                head_size = config.dim // config.n_heads
+                for pos in range(config.seq_len):
+                    yield array('f', rope_row(pos, head_size)), False
+                for k in range(rope_coarse_rows(config)):
+                    yield array('f', rope_row(k * config.seq_len, head_size)), False
+                continue
+            if name == "freq_cis_imag":
+                continue
+            offset, rows, cols, quantize = tensors[name]
+            for r in range(rows):
+                yield data[offset + r * cols:offset + (r + 1) * cols], quantize
+                if name == "w1" and config.ffn_layout == FFN_INTERLEAVED:
+                    offset3 = tensors["w3"][0]
+                    yield data[offset3 + r * cols:offset3 + (r + 1) * cols], quantize
+
+    def tensor_data(self, config):
+        # all weights as floats and {name: (offset, rows, columns, quantize)}
+        if self.tensors_cache is not None:
+            return self.tensors_cache
+        data = array('f')
+        data.frombytes(self.weights_data[:len(self.weights_data) // 4 * 4])
+        tensors = {}
+        offset = 0
+        for name, rows, cols, quantize in self.tensors(config):
+            tensors[name] = (offset, rows, cols, quantize)
+            offset += rows * cols
+        if config.fold_weights:
+            self.fold(config, data, tensors)
+        self.tensors_cache = (data, tensors)
+        return self.tensors_cache
+
+    def fold(self, config, data, tensors):
+        # rmsnorm gains scale the columns of the matrices that follow the norm, 1/sqrt(head_size) scales wq
+        # (RoPE is a rotation, it doesn't mind); nnet64.c then skips both
+        if "wcls" not in tensors:
+            # the final norm can't go into the shared token embedding table, wcls gets its own copy
+            offset, rows, cols, quantize = tensors["token_embedding_table"]
+            tensors["wcls"] = (len(data), rows, cols, quantize)
+            data.extend(data[offset:offset + rows * cols])
+        head_size = config.dim // config.n_heads
+        kv_dim = config.dim * config.n_kv_heads // config.n_heads
+        folds = [
+            ("wq", config.dim, "rms_att_weight", 1.0 / math.sqrt(head_size)),
+            ("wk", kv_dim, "rms_att_weight", 1.0),
+            ("wv", kv_dim, "rms_att_weight", 1.0),
+            ("w1", config.hidden_dim, "rms_ffn_weight", 1.0),
+            ("w3", config.hidden_dim, "rms_ffn_weight", 1.0),
+            ("wcls", config.vocab_size, "rms_final_weight", 1.0),
+        ]
+        for name, rows_per_layer, gain_name, scale in folds:
+            offset, rows, cols, _ = tensors[name]
+            gain_offset = tensors[gain_name][0]
+            for r in range(rows):
+                gain = gain_offset + (r // rows_per_layer) * cols
+                for c in range(cols):
+                    data[offset + r * cols + c] *= data[gain + c] * scale
+        print("RMSNorm gains and attention scale folded into matrices")
+
+    def write_rows(self, file, config):
+        # Q8_0 like llama2.c export.py version 2, but laid out row by row so that a single REU
+        # transfer fetches a whole row: n int8 values followed by one float scale per group
+        # (n/2 bytes of 4-bit pairs for Q4), a tile of a long row takes two transfers
+        gs = config.group_size
+        max_err = 0.0
+        lns_table = None
+        for row, quantize in self.rows(config):
+            if quantize and config.weights_format == WEIGHTS_LNS:
+                if lns_table is None:
+                    lns_table = lns_tables()[0]
+                codes, scales = lns_row(row, gs, lns_table)
+                for j in range(len(row)):
+                    w = lns_table[codes[j] & 0x7f] * scales[j // gs]
+                    max_err = max(max_err, abs(abs(row[j]) - w))
+                file.write(codes.tobytes())
+                file.write(scales.tobytes())
+                continue
+            if quantize and config.weights_format == WEIGHTS_BF16:
+                h = bf16_row(row)
+                for v, w in zip(row, bf16_floats(h)):
+                    max_err = max(max_err, abs(v - w) / abs(v) if v != 0.0 else 0.0)
+                file.write(h.tobytes())
+                continue
+            if not quantize or config.weights_format not in (WEIGHTS_Q8, WEIGHTS_Q4):
+                file.write(row.tobytes())
+                continue
+            q, scales = (q4_row if config.weights_format == WEIGHTS_Q4 else quantize_row)(row, gs)
+            for j in range(len(row)):
+                max_err = max(max_err, abs(row[j] - q[j] * scales[j // gs]))
+            file.write((q4_pack(q, gs) if config.weights_format == WEIGHTS_Q4 else q).tobytes())
+            file.write(scales.tobytes())
+        if config.weights_format == WEIGHTS_Q8:
+            print(f"Q8_0 quantization with group size {gs}, max abs error {max_err:.6f}")
+        if config.weights_format == WEIGHTS_BF16:
+            print(f"bfloat16 weights, max relative error {max_err:.6f}")
+        if config.weights_format == WEIGHTS_LNS:
+            print(f"Log-number-system weights with group size {gs}, max abs error {max_err:.6f}")
+        if config.weights_format == WEIGHTS_Q4:
+            print(f"4-bit quantization with group size {gs}, max abs error {max_err:.6f}")
+
+    def write_layer0_table(self, file, config):
+        # q, k and v of layer 0 (before RoPE) depend only on the token, so they are computed here
+        # for every token, in float32 exactly like rmsnorm() and the matmuls in nnet64.c do it
+        host = HostModel(self, config)
+        gain = None if config.fold_weights else host.rows("rms_att_weight", 0)[0]
+        matrices = host.rows("wq", 0) + host.rows("wk", 0) + host.rows("wv", 0)
+        for token in range(config.vocab_size):
+            xb = host.prepare(host.acts_to_floats(host.rmsnorm(host.embed(token), gain)))
+            out = array('f', [host.dot(w, xb) for w in matrices])
+            file.write(out.tobytes())
+        print(f"Layer 0 q/k/v table for {config.vocab_size} tokens")
+
+    def write_cls_bound(self, file, config):
+        # every row w of wcls as int8 q with one scale s, so that for x = t * p + f quantized the same way
+        #   w.x <= s * t * (q.p) + c * |f| + e * |x|,  c = s * |q|,  e = |w - s * q|
+        # c and e are rounded up well beyond float32 errors of the C64 side, a greedy forward() computes
+        # the exact dot product only for rows whose bound reaches the largest logit so far
+        host = HostModel(self, config)
+        rows = host.rows("wcls" if "wcls" in host.tensors else "token_embedding_table")
+        slack = 0.0
+        for row in rows:
+            q, scales = quantize_row(row, config.dim)
+            scale = scales[0]
+            c = scale * math.sqrt(sum(v * v for v in q)) * (1.0 + 2.0 ** -10)
+            e = math.sqrt(sum((w - scale * v) ** 2 for w, v in zip(row, q)))
+            e += 2.0 ** -10 * math.sqrt(sum(w * w for w in row))
+            slack = max(slack, c + e)
+            file.write(q.tobytes())
+            file.write(array('f', [scale, c, e]).tobytes())
+        print(f"Classifier bounds for {config.vocab_size} rows, slack at most {slack:.4f} * |x|")
+
+    def write_prefixes(self, file, config):
+        # keys and values of every position and x after the last layer at the last position
+        # of each prompt prefix, generate() starts from the longest one that matches
+        host = HostModel(self, config)
+        states = {(): ([([], []) for l in range(config.n_layers)], None)}
+        for tokens in config.prefixes:
+            n = max(i for i in range(len(tokens)) if tuple(tokens[:i]) in states)
+            cache, x = states[tuple(tokens[:n])]
+            for i in range(n, len(tokens)):
+                cache = [(keys[:], values[:]) for keys, values in cache]
+                x = host.forward(tokens[i], cache)
+                states[tuple(tokens[:i + 1])] = (cache, x)
+            file.write(array('i' if config.fixed_point else 'f', x).tobytes())
+            for keys, values in cache:
+                file.write(b"".join(host.kv_bytes(k) for k in keys))
+                file.write(b"".join(host.kv_bytes(v) for v in values))
+        print(f"Prefix states for {len(config.prefixes)} prompt openings")
+
     def pad_to_next_multiple(self, filename, multiples=(2, 4, 8, 16)):
         file_size = os.path.getsize(filename)
         next_multiple = min(m for m in multiples if m * 1024 * 1024 > file_size)
@@ -36,6 +702,21 @@ class Config:
         self.n_kv_heads = 0
         self.vocab_size = 0
         self.seq_len = 0
+        self.shared_weights = True
+        self.weights_format = WEIGHTS_F32
+        self.group_size = 64
+        self.ffn_layout = FFN_SEPARATE
+        self.ffn_epsilon = 0.0 # SwiGLU outputs below this are flushed to zero, 0 = exact
+        self.exp_table = False # exp() from tables instead of the polynomial
+        self.fixed_point = False # Q15.16 activations
+        self.layer0_table = True
+        self.fold_weights = False
+        self.cls_bound = True
+        self.shortlist_margin = 0 # approximate sampling, 0 = off
+        self.kv_format = KV_F32
+        self.kv_sinks = 0
+        self.kv_window = 0
+        self.prefixes = [] # token lists of the baked prompt prefixes
 
     def read_checkpoint(self, checkpoint, output_filename="config.bin"):
         with open(checkpoint, "rb") as file:
@@ -43,7 +724,9 @@ class Config:
             (self.dim, self.hidden_dim, self.n_layers, self.n_heads, 
              self.n_kv_heads, self.vocab_size, self.seq_len) = struct.unpack('iiiiiii', config_data)
 
-            shared_weights = self.vocab_size > 0
+            self.checkpoint_shared = self.vocab_size > 0
+            # folding the final norm into wcls needs it apart from the token embedding table
+            self.shared_weights = self.checkpoint_shared and not self.fold_weights
             self.vocab_size = abs(self.vocab_size)
 
         with open(output_filename, "wb") as file:
@@ -54,7 +737,216 @@ class Config:
             file.write(struct.pack('h', self.n_kv_heads))
             file.write(struct.pack('h', self.vocab_size))
             file.write(struct.pack('h', self.seq_len))
-            file.write(struct.pack('h', int(shared_weights)))
+            file.write(struct.pack('h', int(self.shared_weights)))
+            file.write(struct.pack('h', self.weights_format))
+            file.write(struct.pack('h', self.group_size))
+            file.write(struct.pack('h', self.ffn_layout))
+            file.write(struct.pack('h', int(self.layer0_table)))
+            file.write(struct.pack('h', int(self.fold_weights)))
+            file.write(struct.pack('h', self.kv_format))
+            file.write(struct.pack('h', self.kv_sinks))
+            file.write(struct.pack('h', self.kv_window))
+            file.write(struct.pack('h', int(self.cls_bound)))
+            file.write(struct.pack('h', self.shortlist_margin))
+
+    def row_size(self, n):
+        # size in bytes of one row of n weights in REU image
+        if self.weights_format in (WEIGHTS_Q8, WEIGHTS_LNS):
+            return n + (n + self.group_size - 1) // self.group_size * 4
+        if self.weights_format == WEIGHTS_Q4:
+            return n // 2 + (n + self.group_size - 1) // self.group_size * 4
+        if self.weights_format == WEIGHTS_BF16:
+            return n * 2
+        return n * 4
+
+    def cls_bound_row_size(self):
+        # int8 row of wcls followed by its scale and the two error bound factors
+        return self.dim + 3 * 4
+
+    def kv_pos(self):
+        # size in bytes of one position of the kv cache, a key or value vector of one head
+        # is float32, or int8 followed by its float scale
+        head_size = self.dim // self.n_heads
+        kv_head = head_size + 4 if self.kv_format == KV_Q8 else 4 * head_size
+        return self.n_kv_heads * kv_head, kv_head
+
+    def reu_size(self):
+        # weights, kv cache, its token history and the prefill scratch, see malloc_run_state() in transformer64.c
+        kv_slots = self.kv_sinks + self.kv_window if self.kv_window > 0 else self.seq_len
+        # PREFILL_BATCH in transformer64.h
+        batch = 8 if self.hidden_dim <= 192 else 4 if self.hidden_dim <= 384 else 2 if self.hidden_dim <= 768 else 1
+        kv = 2 * self.n_layers * kv_slots * self.kv_pos()[0] + 2 * kv_slots
+        # PREFILL_HB, pf_hb also holds the float keys and values of the batch for the int8 kv cache
+        kv_dim = self.dim * self.n_kv_heads // self.n_heads
+        hb = max(self.hidden_dim, 2 * kv_dim) if self.kv_format == KV_Q8 else self.hidden_dim
+        return self.reu_layout()["end"] + kv + 4 * batch * (3 * self.dim + hb)
+
+    def prefix_size(self, tokens):
+        # x and the keys and values of every layer for one baked prefix
+        return 4 * self.dim + 2 * self.n_layers * len(tokens) * self.kv_pos()[0]
+
+    def reu_layout(self):
+        # REU addresses of the weights, past the signature magic number, in REU image order
+        head_size = self.dim // self.n_heads
+        kv_dim = self.dim * self.n_kv_heads // self.n_heads
+        layers = self.n_layers
+        row_dim = self.row_size(self.dim)
+        row_hidden = self.row_size(self.hidden_dim)
+        sizes = [
+            ("token_embedding_table", row_dim * self.vocab_size),
+            ("rms_att_weight", 4 * layers * self.dim),
+            ("wq", row_dim * layers * self.dim),
+            ("wk", row_dim * layers * kv_dim),
+            ("wv", row_dim * layers * kv_dim),
+            ("wo", row_dim * layers * self.dim),
+            ("rms_ffn_weight", 4 * layers * self.dim),
+        ]
+        if self.ffn_layout == FFN_INTERLEAVED:
+            sizes += [("w1", 2 * row_dim * layers * self.hidden_dim), ("w2", row_hidden * layers * self.dim)]
+        else:
+            sizes += [("w1", row_dim * layers * self.hidden_dim), ("w2", row_hidden * layers * self.dim), ("w3", row_dim * layers * self.hidden_dim)]
+        sizes += [
+            ("rms_final_weight", 4 * self.dim),
+            ("rope", 4 * self.seq_len * head_size),
+            ("rope_coarse", 4 * rope_coarse_rows(self) * head_size),
+            ("wcls", 0 if self.shared_weights else row_dim * self.vocab_size),
+            ("layer0_qkv", 4 * self.vocab_size * (self.dim + 2 * kv_dim) if self.layer0_table else 0),
+            ("wcls_bound", self.cls_bound_row_size() * self.vocab_size if self.cls_bound else 0),
+            ("prefixes", sum(self.prefix_size(tokens) for tokens in self.prefixes)),
+        ]
+        layout = {}
+        ptr = 4
+        for name, size in sizes:
+            layout[name] = ptr
+            ptr += size
+        if self.ffn_layout == FFN_INTERLEAVED:
+            layout["w3"] = layout["w1"] + row_dim
+        if self.shared_weights:
+            layout["wcls"] = layout["token_embedding_table"]
+        layout["end"] = ptr
+        return layout
+
+    def write_header(self, checkpoint, output_filename="model64.h", data_files=("config.bin", "weights.reu")):
+        # model shape and REU addresses as compile-time constants for nnet64.c and transformer64.c
+        kv_dim = self.dim * self.n_kv_heads // self.n_heads
+        row_dim = self.row_size(self.dim)
+        row_hidden = self.row_size(self.hidden_dim)
+        row_ffn = 2 * row_dim if self.ffn_layout == FFN_INTERLEAVED else row_dim
+        layout = self.reu_layout()
+        head_size = self.dim // self.n_heads
+        kv_pos, kv_head = self.kv_pos()
+        # streaming: sinks stay, the window is a ring buffer of the most recent positions
+        kv_slots = self.kv_sinks + self.kv_window if self.kv_window > 0 else self.seq_len
+        kv_layer = kv_slots * kv_pos
+        key_cache = layout["end"]
+        value_cache = key_cache + self.n_layers * kv_layer
+        lines = [
+            f"// generated by generate-model-files.py from {os.path.basename(checkpoint)}, together with config.bin and weights.reu",
+            "",
+            "#ifndef MODEL64_H",
+            "#define MODEL64_H",
+            "",
+            "// model shape",
+            f"#define MODEL_DIM {self.dim}",
+            f"#define MODEL_HIDDEN_DIM {self.hidden_dim}",
+            f"#define MODEL_N_LAYERS {self.n_layers}",
+            f"#define MODEL_N_HEADS {self.n_heads}",
+            f"#define MODEL_N_KV_HEADS {self.n_kv_heads}",
+            f"#define MODEL_VOCAB_SIZE {self.vocab_size}",
+            f"#define MODEL_SEQ_LEN {self.seq_len}",
+            f"#define MODEL_HEAD_SIZE {head_size}",
+            f"#define MODEL_KV_DIM {kv_dim}",
+            f"#define MODEL_KV_MUL {self.n_heads // self.n_kv_heads}",
+            "",
+            "// weights format",
+            f"#define MODEL_WEIGHTS_FORMAT {self.weights_format}",
+            f"#define MODEL_GROUP_SIZE {self.group_size}",
+            f"#define MODEL_FFN_LAYOUT {self.ffn_layout}",
+            f"#define MODEL_EXP_TABLE {int(self.exp_table)} // exp() from tables instead of the polynomial (approximate)",
+            f"#define MODEL_FIXED_POINT {int(self.fixed_point)} // Q15.16 activations for residual adds, rmsnorm() and SwiGLU (approximate)",
+            f"#define MODEL_FFN_EPSILON {float(self.ffn_epsilon)!r}f // SwiGLU outputs below this are flushed to zero, the float32 kernel of w2 skips their multiplications, 0 = exact",
+            f"#define MODEL_LAYER0_TABLE {int(self.layer0_table)}",
+            f"#define MODEL_FOLDED {int(self.fold_weights)}",
+            f"#define MODEL_CLS_BOUND {int(self.cls_bound)}",
+            f"#define MODEL_SHORTLIST_MARGIN {self.shortlist_margin} // sampling leaves out logits this many temperatures below the largest, 0 = off",
+            f"#define MODEL_ROWSIZE_DIM {row_dim} // bytes in a weight row of dim elements",
+            f"#define MODEL_ROWSIZE_HIDDEN {row_hidden} // bytes in a weight row of hidden_dim elements",
+            f"#define MODEL_ROWSIZE_FFN {row_ffn} // bytes from one w1 row to the next",
+            f"#define MODEL_ROWSIZE_CLS_BOUND {self.cls_bound_row_size()} // bytes in a row of the wcls bound table",
+            "",
+            "// REU addresses",
+        ]
+        for name in ["token_embedding_table", "rms_att_weight", "wq", "wk", "wv", "wo", "rms_ffn_weight", "w1", "w2", "w3", "rms_final_weight", "rope", "rope_coarse", "wcls", "layer0_qkv", "wcls_bound"]:
+            lines.append(f"#define MODEL_{name.upper()} 0x{layout[name]:06x}ul")
+        lines += [
+            f"#define MODEL_REU_END 0x{layout['end']:06x}ul // first free byte after the weights",
+            "",
+            "// kv cache, right after the weights",
+            f"#define MODEL_KEY_CACHE 0x{key_cache:06x}ul",
+            f"#define MODEL_VALUE_CACHE 0x{value_cache:06x}ul",
+            f"#define MODEL_KV_FORMAT {self.kv_format}",
+            f"#define MODEL_KV_LAYER 0x{kv_layer:06x}ul // bytes of one layer",
+            f"#define MODEL_KV_POS {kv_pos} // bytes of one position",
+            f"#define MODEL_KV_HEAD {kv_head} // bytes of one head at one position",
+            f"#define MODEL_KV_SINKS {self.kv_sinks} // first positions that are always attended to in streaming mode",
+            f"#define MODEL_KV_WINDOW {self.kv_window} // most recent positions in streaming mode, 0 for a linear cache of seq_len positions",
+            f"#define MODEL_KV_SLOTS {kv_slots} // positions in the kv cache",
+            "",
+            "// weights and kv cache of every layer, no 32-bit multiplications needed",
+            "const LayerWeights64 model_layers[MODEL_N_LAYERS] = {",
+        ]
+        for l in range(self.n_layers):
+            addrs = [
+                layout["rms_att_weight"] + l * 4 * self.dim,
+                layout["wq"] + l * self.dim * row_dim,
+                layout["wk"] + l * kv_dim * row_dim,
+                layout["wv"] + l * kv_dim * row_dim,
+                layout["wo"] + l * self.dim * row_dim,
+                layout["rms_ffn_weight"] + l * 4 * self.dim,
+                layout["w1"] + l * self.hidden_dim * row_ffn,
+                layout["w2"] + l * self.dim * row_hidden,
+                layout["w3"] + l * self.hidden_dim * row_ffn,
+                key_cache + l * kv_layer,
+                value_cache + l * kv_layer,
+            ]
+            lines.append("    { " + ", ".join(f"0x{a:06x}ul" for a in addrs) + " },")
+        lines += [
+            "};",
+            "",
+            "// baked prompt prefixes: tokens, then REU address of x after the last layer at the last position",
+            "// followed by keys and values of all positions for every layer",
+            f"#define MODEL_N_PREFIXES {len(self.prefixes)}",
+        ]
+        if self.prefixes:
+            tokens = [t for prefix in self.prefixes for t in prefix]
+            lines += [
+                "const int16_t model_prefix_tokens[] = {",
+                "    " + ", ".join(str(t) for t in tokens),
+                "};",
+                "const BakedPrefix64 model_prefixes[MODEL_N_PREFIXES] = {",
+            ]
+            first = 0
+            state = layout["prefixes"]
+            for prefix in self.prefixes:
+                lines.append(f"    {{ {len(prefix)}, {first}, 0x{state:06x}ul }},")
+                first += len(prefix)
+                state += self.prefix_size(prefix)
+            lines.append("};")
+        # everything generated so far, so that a saved session is never restored into another model or build
+        checksum = zlib.crc32("\n".join(lines).encode())
+        for filename in data_files:
+            with open(filename, "rb") as file:
+                checksum = zlib.crc32(file.read(), checksum)
+        lines += [
+            "",
+            "// crc32 of config.bin, weights.reu and the lines above",
+            f"#define MODEL_CHECKSUM 0x{checksum:08x}ul",
+            "",
+            "#endif // MODEL64_H",
+            "",
+        ]
+        with open(output_filename, "w") as file:
+            file.write("\n".join(lines))
 
 class Tokenizer:
     def __init__(self):
@@ -82,6 +974,31 @@ class Tokenizer:
         self.sorted_vocab = sorted([(self.vocab[i], i) for i in range(vocab_size)], key=lambda x: x[0])
         self.str_buffer = bytearray((self.max_token_length * 2 + 1 + 2))
 
+    def encode(self, text):
+        # encode() in tokenizer64.c with BOS and without EOS
+        lookup = {bytes(token): i for i, token in enumerate(self.vocab)}
+        tokens = [1]
+        if text:
+            tokens.append(lookup[b" "])
+        for c in text:
+            piece = c.encode("utf-8")
+            if piece in lookup:
+                tokens.append(lookup[piece])
+            else:
+                tokens += [b + 3 for b in piece]
+        while True:
+            best_score = -1000000000
+            best_idx = -1
+            for i in range(len(tokens) - 1):
+                id = lookup.get(bytes(self.vocab[tokens[i]] + self.vocab[tokens[i + 1]]), -1)
+                if id != -1 and self.vocab_scores[id] > best_score:
+                    best_score = self.vocab_scores[id]
+                    best_id = id
+                    best_idx = i
+            if best_idx == -1:
+                return tokens
+            tokens[best_idx:best_idx + 2] = [best_id]
+
     def save_tokenizer(self, save_path):
         with open(save_path, "wb") as file:
             # Write vocab_size as uint16_t
@@ -149,19 +1066,78 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Generate model files from checkpoints and tokenizer data.")
     parser.add_argument("--checkpoint", default="stories260K.bin", help="Path to the model checkpoint file. Default is 'stories260K.bin'.")
     parser.add_argument("--tokenizer", default="tok512.bin", help="Path to the tokenizer file. Default is 'tok512.bin'.")
+    parser.add_argument("--quantize", default="f32", choices=WEIGHTS_FORMATS.keys(), help="Weights format in REU image: f32 (unchanged), q8 (int8 with float scale per group) bf16 (bfloat16, half the size, matmuls with exact products), lns (sign and 7-bit log2 magnitude with float scale per group, products by table lookup) or q4 (4-bit with float scale per group, for models larger than stories260K). Default is 'f32'.")
+    parser.add_argument("--group-size", type=int, default=64, help="Number of weights sharing one scale for quantized formats. Default is 64.")
+    parser.add_argument("--ffn-layout", default="separate", choices=FFN_LAYOUTS.keys(), help="Layout of w1/w3 in REU image: separate (as in checkpoint) or interleaved (row by row, for fused FFN fetch). Default is 'separate'.")
+    parser.add_argument("--ffn-epsilon", type=float, default=0.0, help="Flush SwiGLU outputs smaller than this to zero, the float32 kernel of the down-projection (w2) skips their multiplications. The rows of w2 are still fetched whole, and with q8, lns or q4 weights nothing is saved. Default is 0 (exact).")
+    parser.add_argument("--exp", default="poly", choices=("poly", "table"), help="exp() for sigmoid, attention and softmax: poly (polynomial, as before) or table (two lookups and a multiply, relative error below 1e-5). Default is 'poly'.")
+    parser.add_argument("--fixed-point", default=False, action=argparse.BooleanOptionalAction, help="Keep activations as Q15.16 fixed-point numbers, so that residual adds, RMSNorm and SwiGLU run on integers. The matmuls stay float32. Best together with --fold-weights. Default is off.")
+    parser.add_argument("--layer0-table", default=True, action=argparse.BooleanOptionalAction, help="Precompute q/k/v of layer 0 for every token and store them in REU image. Default is on.")
+    parser.add_argument("--fold-weights", default=False, action=argparse.BooleanOptionalAction, help="Fold RMSNorm gains and 1/sqrt(head_size) into the following matrices, unsharing wcls if needed. Default is off.")
+    parser.add_argument("--cls-bound", default=True, action=argparse.BooleanOptionalAction, help="Store an int8 copy of wcls with error bounds, so that greedy sampling (temperature 0) computes only the logits that can be the largest, with the same result. float32 and bfloat16 weights only. Default is on.")
+    parser.add_argument("--shortlist-margin", type=int, default=0, help="Approximate sampling (temperature > 0): compute only the logits whose bound from --cls-bound comes within this many temperatures of the largest one, the others are left out. Default is 0 (off, exact).")
+    parser.add_argument("--kv-cache", default="f32", choices=KV_FORMATS.keys(), help="Format of the KV cache in REU: f32 or q8 (int8 with float scale per head vector). Default is 'f32'.")
+    parser.add_argument("--kv-window", type=int, default=0, help="Streaming mode: keep only this many recent positions in a ring buffer KV cache, generation can go beyond seq_len. Default is 0 (off).")
+    parser.add_argument("--kv-sinks", type=int, default=4, help="Streaming mode: number of first positions (attention sinks) kept in the KV cache besides the window. Default is 4.")
+    parser.add_argument("--prefixes", nargs="*", default=["Once upon a time", "Once upon a time, there was a little girl named Lily", "One day"], help="Prompt openings whose states are precomputed and stored in REU image, BOS alone is always included. Default is a few story openings.")
     args = parser.parse_args()
+    if not 0 < args.group_size < 256:
+        parser.error("group size must be between 1 and 255")
+    if args.quantize == "q4" and args.group_size % 2:
+        parser.error("4-bit weights need an even group size")
+    if args.ffn_epsilon < 0.0:
+        parser.error("ffn epsilon can't be negative")
+    if args.shortlist_margin < 0:
+        parser.error("shortlist margin can't be negative")
+    if args.shortlist_margin > 0 and (not args.cls_bound or args.quantize not in ("f32", "bf16")):
+        parser.error("shortlist margin needs the classifier bounds of float32 or bfloat16 weights")
+    if args.kv_window < 0 or args.kv_sinks < 0:
+        parser.error("kv window and sinks can't be negative")
 
     config = Config()
+    config.weights_format = WEIGHTS_FORMATS[args.quantize]
+    config.group_size = args.group_size
+    config.ffn_layout = FFN_LAYOUTS[args.ffn_layout]
+    config.ffn_epsilon = args.ffn_epsilon
+    config.exp_table = args.exp == "table"
+    config.fixed_point = args.fixed_point
+    config.layer0_table = args.layer0_table
+    config.fold_weights = args.fold_weights
+    config.cls_bound = args.cls_bound and config.weights_format in (WEIGHTS_F32, WEIGHTS_BF16)
+    config.shortlist_margin = args.shortlist_margin
+    config.kv_format = KV_FORMATS[args.kv_cache]
+    config.kv_sinks = args.kv_sinks if args.kv_window > 0 else 0
+    config.kv_window = args.kv_window
     config.read_checkpoint(args.checkpoint, "config.bin")
+    if config.kv_sinks + config.kv_window > config.seq_len:
+        parser.error(f"kv sinks and window must fit in seq_len ({config.seq_len})")
+    if config.weights_format == WEIGHTS_Q4 and config.hidden_dim % 2:
+        parser.error("4-bit weights need an even hidden_dim")
+    # the attention kernels count in 8 bits, the matmuls go in tiles for any dim and hidden_dim
+    kv_heads = config.n_heads // config.n_kv_heads * config.dim // config.n_heads
+    if config.dim // config.n_heads > 255 or (config.kv_format == KV_F32 and kv_heads > 255):
+        parser.error("the query heads of a kv head must have fewer than 256 elements, with --kv-cache q8 a single head")
 
     tokenizer = Tokenizer()
     tokenizer.build_tokenizer(args.tokenizer, config.vocab_size)
     tokenizer.save_tokenizer("tokenizer.bin")
+    vocab_ram = os.path.getsize("tokenizer.bin") + VOCAB_RAM_PER_TOKEN * config.vocab_size
+    if vocab_ram > VOCAB_RAM:
+        parser.error(f"the vocabulary of {config.vocab_size} tokens needs {vocab_ram // 1024}KB of C64 RAM, more than {VOCAB_RAM // 1024}KB")
+    kv_slots = config.kv_sinks + config.kv_window if config.kv_window > 0 else config.seq_len
+    for text in [""] + args.prefixes:
+        tokens = tokenizer.encode(text)
+        if tokens not in config.prefixes and len(tokens) <= kv_slots:
+            config.prefixes.append(tokens)
     tokenizer.free_tokenizer()
+    if config.reu_size() > 16 * 1024 * 1024:
+        parser.error(f"the model needs {config.reu_size() / (1024 * 1024):.1f}MB of REU, more than 16MB, try --quantize q4 or --kv-window")
 
     weights = Weights()
-    weights.read_weights(args.checkpoint, "weights.reu")
+    weights.read_weights(args.checkpoint, config, "weights.reu")
+    config.write_header(args.checkpoint, "model64.h")
 
     print(f"Tokenizer saved to tokenizer.bin")
     print(f"Config saved to config.bin")
+    print(f"Model constants saved to model64.h")
     print(f"Weights saved as REU image to weights.reu")
@@ -8,10 +8,99 @@
 
 #include "nnet64.h"
 #include "util.h"
+#include "session64.h"
 
 // ----------------------------------------------------------------------------
 // generation loop
 
+// number of leading tokens (up to n) whose keys and values are still in the kv cache from the previous run
+uint16_t kv_common_prefix(RunState64* s, int16_t* tokens, uint16_t n) {
+    uint16_t len = s->kv_len < n ? s->kv_len : n;
+    int16_t token;
+    for (uint16_t i = 0; i < len; i++) {
+        REU_getf(s->kv_tokens + i * sizeof(int16_t), (float*)&token, sizeof(int16_t));
+        if (token != tokens[i]) { return i; }
+    }
+    return len;
+}
+
+// remember the token whose keys and values were just stored at pos
+void kv_track(RunState64* s, int16_t token, uint16_t pos) {
+    if (pos < MODEL_KV_SLOTS) {
+        REU_putf(s->kv_tokens + pos * sizeof(int16_t), (float*)&token, sizeof(int16_t));
+        s->kv_len = pos + 1;
+    } else {
+        // streaming kv cache went round, only the sinks are left from the start
+        s->kv_len = MODEL_KV_SINKS;
+    }
+}
+
+#if MODEL_N_PREFIXES > 0
+// the longest baked prefix of the prompt (n tokens) that ends before pos,
+// or the whole prompt when pos is its last token
+const BakedPrefix64* baked_prefix(int16_t* tokens, uint16_t n, uint16_t pos) {
+    const BakedPrefix64* best = NULL;
+    for (uint8_t i = 0; i < MODEL_N_PREFIXES; i++) {
+        const BakedPrefix64* bp = &model_prefixes[i];
+        if (bp->len > pos && !(bp->len == n && pos == n - 1)) { continue; }
+        if (best != NULL && bp->len <= best->len) { continue; }
+        if (memcmp(model_prefix_tokens + bp->tokens, tokens, bp->len * sizeof(int16_t)) == 0) { best = bp; }
+    }
+    return best;
+}
+#endif
+
+// the main loop, from token at pos on; prompt tokens after pos are forced instead of sampled,
+// logits are those of token if already known
+void generate_loop(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, int16_t* prompt_tokens, uint16_t num_prompt_tokens, int16_t token, uint16_t pos, uint16_t steps, float* logits) {
+    RunState64* s = &transformer->state;
+    int16_t next;        // will store the next token in the sequence
+    ui_setapproximate(s->shortlist_margin > 0.0 || MODEL_FFN_EPSILON > 0.0 || MODEL_EXP_TABLE || MODEL_FIXED_POINT || KV_QUANTIZED);
+    while (pos < steps) {
+
+        ui_setcurrenttoken(pos+1,steps);
+
+        // forward the transformer to get logits for the next token, unless a baked prefix had them
+        if (logits == NULL) {
+            logits = forward(transformer, token, pos);
+        }
+        kv_track(s, token, pos);
+
+        // advance the state machine
+        if (pos + 1 < num_prompt_tokens) {
+            // if we are still processing the input prompt, force the next prompt token
+            next = prompt_tokens[pos + 1];
+        } else {
+            // otherwise sample the next token from the logits
+            ui_settopstatus("sampling");
+            next = sample(sampler, logits, s->n_logits);
+            if (s->n_logits < MODEL_VOCAB_SIZE) { next = s->logit_tokens[next]; }
+        }
+        logits = NULL;
+        pos++;
+
+        // data-dependent terminating condition: the BOS (=1) token delimits sequences
+        if (next == 1) { break; }
+
+        // print the token as string, decode it with the Tokenizer object
+        char* piece = decode(tokenizer, token, next);
+        safe_printf(piece);
+        token = next;
+
+        // <s> between tokens saves the session, it can be resumed from the start screen later;
+        // any other key is read and ignored, so that it doesn't answer the next prompt after generation
+        if (pos < steps && pos + 1 >= num_prompt_tokens && kbhit() && getch() == 's') {
+            ui_settopstatus("saving session");
+            if (session_save(transformer, sampler, token, pos, steps) == 0) {
+                ui_settopstatus("session saved");
+            } else {
+                ui_settopstatus("ERROR: SESSION NOT SAVED");
+            }
+        }
+
+    }
+}
+
 void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, uint16_t steps) {
     char *empty_prompt = (char*)"";
     if (prompt == NULL) { prompt = empty_prompt; }
@@ -34,38 +123,86 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
 
     // prepare nnet buffers
     nnet_init(transformer);
+    transformer->state.greedy = sampler->temperature == 0.0;
+    transformer->state.shortlist_margin = MODEL_SHORTLIST_MARGIN * sampler->temperature;
+
+    // all prompt tokens but the last one only fill the kv cache, run them through the model in batches
+    // the ones the previous run left in the kv cache (at least BOS) are skipped, and so are those
+    // of a longer baked prefix that is copied into the kv cache instead
+    RunState64* s = &transformer->state;
+    uint16_t pos = num_prompt_tokens - 1; // position in the sequence
+    if (pos > steps) { pos = steps; }
+    if (pos > MODEL_KV_SLOTS) { pos = MODEL_KV_SLOTS; } // prefill doesn't go round the streaming kv cache
+    uint16_t reused = kv_common_prefix(s, prompt_tokens, pos);
+    uint16_t start = reused;
+    float* logits = NULL; // already known when a baked prefix covers the whole prompt
+#if MODEL_N_PREFIXES > 0
+    const BakedPrefix64* bp = baked_prefix(prompt_tokens, num_prompt_tokens, pos);
+    if (bp != NULL && bp->len > start) {
+        ui_settopstatus("restoring prefix");
+        prefix_restore(transformer, bp, start);
+        start = bp->len;
+        if (start > pos) {
+            // the last prompt token too, its x is restored as well
+            logits = classify(transformer);
+            start = pos;
+        }
+    }
+#endif
+    if (pos > 0) {
+        ui_setcurrenttoken(pos, steps);
+        if (start < pos) {
+            prefill(transformer, prompt_tokens, start, pos);
+        }
+        if (reused < pos) {
+            REU_putf(s->kv_tokens + reused * sizeof(int16_t), (float*)(prompt_tokens + reused), (pos - reused) * sizeof(int16_t));
+        }
+        s->kv_len = pos;
+        for (uint16_t i = 0; i < pos; i++) {
+            safe_printf(decode(tokenizer, prompt_tokens[i], prompt_tokens[i + 1]));
+        }
+    }
 
-    // start the main loop
-    int16_t next;        // will store the next token in the sequence
-    int16_t token = prompt_tokens[0]; // kick off with the first token in the prompt
-    uint16_t pos = 0;     // position in the sequence
-    while (pos < steps) {
+    // start the main loop, kick off with the last token in the prompt
+    generate_loop(transformer, tokenizer, sampler, prompt_tokens, num_prompt_tokens, prompt_tokens[pos], pos, steps, logits);
 
-        ui_setcurrenttoken(pos+1,steps);
+    free(prompt_tokens);
+}
 
-        // forward the transformer to get logits for the next token
-        float* logits = forward(transformer, token, pos);
+// continue the generation session saved to disk
+uint8_t resume(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler) {
+    RunState64* s = &transformer->state;
+    Session64 session;
 
-        // advance the state machine
-        if (pos < num_prompt_tokens - 1) {
-            // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos + 1];
-        } else {
-            // otherwise sample the next token from the logits
-            ui_settopstatus("sampling");
-            next = sample(sampler, logits);
-        }
-        pos++;
+    ui_settopstatus("loading session");
 
-        // data-dependent terminating condition: the BOS (=1) token delimits sequences
-        if (next == 1) { break; }
+    // prepare nnet buffers
+    nnet_init(transformer);
 
-        // print the token as string, decode it with the Tokenizer object
-        char* piece = decode(tokenizer, token, next);
-        safe_printf(piece);
-        token = next;
+    if (session_load(transformer, sampler, &session) != 0) {
+        ui_settopstatus("ERROR: NO SESSION LOADED");
+        return 1;
+    }
+    transformer->state.greedy = sampler->temperature == 0.0;
+    transformer->state.shortlist_margin = MODEL_SHORTLIST_MARGIN * sampler->temperature;
+    ui_cleartopstatus();
 
+    ui_gotooutput();
+
+    // print the text so far again, as far as the token history goes
+    int16_t prev = 1;
+    int16_t token;
+    for (uint16_t i = 0; i < s->kv_len; i++) {
+        REU_getf(s->kv_tokens + i * sizeof(int16_t), (float*)&token, sizeof(int16_t));
+        if (i > 0) { safe_printf(decode(tokenizer, prev, token)); }
+        prev = token;
     }
+    if (s->kv_len < session.pos) {
+        // streaming kv cache went round, the middle is gone
+        safe_printf(" ...");
+    }
+    safe_printf(decode(tokenizer, prev, session.token));
 
-    free(prompt_tokens);
+    generate_loop(transformer, tokenizer, sampler, NULL, 0, session.token, session.pos, session.steps, NULL);
+    return 0;
 }
@@ -13,5 +13,6 @@
 
 // generation loop
 void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, uint16_t steps);
+uint8_t resume(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler);
 
 #endif // GENERATE_H
\ No newline at end of file
@@ -12,6 +12,7 @@
 #include "sampler64.h"
 #include "util.h"
 #include "generate64.h"
+#include "session64.h"
 #include "ui64.c"
 #include "math.c"
 #include "tokenizer64.c"
@@ -19,6 +20,7 @@
 #include "nnet64.c"
 #include "sampler64.c"
 #include "util64.c"
+#include "session64.c"
 #include "generate64.c"
 
 #include <c64/cia.h>
@@ -57,14 +59,24 @@ int main(void) {
         ui_startup_screen(c);
 
         ui_inference_screen_init();
-        ui_get_prompt(prompt);
-
-        char *jiffyclock = (char *)0xA2;    
-        volatile uint32_t seed;
-        seed = cia1.ta << 16 | vic.raster << 8 | (*jiffyclock);
-        build_sampler(&sampler, c->vocab_size, temperature, topp, seed);
-
-        generate(&transformer, &tokenizer, &sampler, prompt, steps);
+        if (ui_resume) {
+            clock_init();
+            // temperature, top-p and rng state come from the session
+            build_sampler(&sampler, c->vocab_size, temperature, topp, 0);
+
+            if (resume(&transformer, &tokenizer, &sampler) != 0) {
+                getch(); // leave the error on screen
+            }
+        } else {
+            ui_get_prompt(prompt);
+
+            char *jiffyclock = (char *)0xA2;    
+            volatile uint32_t seed;
+            seed = cia1.ta << 16 | vic.raster << 8 | (*jiffyclock);
+            build_sampler(&sampler, c->vocab_size, temperature, topp, seed);
+
+            generate(&transformer, &tokenizer, &sampler, prompt, steps);
+        }
 
         free_sampler(&sampler);
 
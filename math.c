@@ -52,7 +52,8 @@ float my_cos(float f)
 	return my_sin(f + 0.5 * PI);
 }
 
-float my_exp(float f)
+// e^f with a polynomial for the fraction of f*log_2(e)
+float my_exp_poly(float f)
 {
     static const union {
         uint32_t i;
@@ -65,6 +66,7 @@ float my_exp(float f)
 	float	ff = floor(f), g = f - ff; // split into integer and fractional part
 	
 	int	fi = (int)ff;
+	if (fi < -126) return 0.0; // would wrap around the exponent bits below
 	
 	union {
 		float	f;
@@ -85,3 +87,54 @@ float my_exp(float f)
 
 	return s * x.f;
 }
+
+#if MODEL_EXP_TABLE
+// e^f = 2^i * 2^(a/256) * 2^(b/65536) with f*log_2(e) rounded to 1/65536, two table lookups
+// and one multiply instead of the polynomial, relative error below 1e-5
+float exp_hi[256]; // 2^(a/256)
+float exp_lo[256]; // 2^(b/65536)
+
+void exp_table_init(void) {
+    for (uint16_t i = 0; i < 256; i++) {
+        exp_hi[i] = my_exp_poly(i * (0.69314718056 / 256.0));
+        exp_lo[i] = my_exp_poly(i * (0.69314718056 / 65536.0));
+    }
+}
+
+float my_exp_table(float f)
+{
+    if (f < -44.0) return 0.0; // below 2^-63, nothing left in a softmax
+    if (f > 44.0) f = 44.0;    // only sigmoid goes there, 1/(1+e^44) is 0 already
+
+	union {
+		float	f;
+		uint8_t	b[4];
+		int		i[2];
+	}	x;
+
+    // adding 1.5*2^23 rounds f*log_2(e)*2^16 to an integer and leaves it in the mantissa bits:
+    // b[0] and b[1] are the fraction, the low 7 bits of b[2] the integer part + 64
+    x.f = f * (1.442695041 * 65536.0) + 12582912.0;
+    int e = (int)(x.b[2] & 0x7f) - 64;
+
+    // 2^(a/256) * 2^(b/65536) is in [1,2), add the integer part to its exponent
+    x.f = exp_hi[x.b[1]] * exp_lo[x.b[0]];
+    x.i[1] += e << 7;
+    return x.f;
+}
+
+#define my_exp my_exp_table
+#else
+#define my_exp my_exp_poly
+#endif
+
+#if MODEL_FIXED_POINT
+// logistic sigmoid of t/16-8 for t=0..256 in Q1.15, for the fixed-point SwiGLU
+int16_t sigmoid_q15[257];
+
+void sigmoid_table_init(void) {
+    for (uint16_t t = 0; t <= 256; t++) {
+        sigmoid_q15[t] = (int16_t)(32768.0 / (1.0 + my_exp(8.0 - t * 0.0625)) + 0.5);
+    }
+}
+#endif
@@ -0,0 +1,89 @@
+// generated by generate-model-files.py from stories260K.bin, together with config.bin and weights.reu
+
+#ifndef MODEL64_H
+#define MODEL64_H
+
+// model shape
+#define MODEL_DIM 64
+#define MODEL_HIDDEN_DIM 172
+#define MODEL_N_LAYERS 5
+#define MODEL_N_HEADS 8
+#define MODEL_N_KV_HEADS 4
+#define MODEL_VOCAB_SIZE 512
+#define MODEL_SEQ_LEN 512
+#define MODEL_HEAD_SIZE 8
+#define MODEL_KV_DIM 32
+#define MODEL_KV_MUL 2
+
+// weights format
+#define MODEL_WEIGHTS_FORMAT 0
+#define MODEL_GROUP_SIZE 64
+#define MODEL_FFN_LAYOUT 0
+#define MODEL_EXP_TABLE 0 // exp() from tables instead of the polynomial (approximate)
+#define MODEL_FIXED_POINT 0 // Q15.16 activations for residual adds, rmsnorm() and SwiGLU (approximate)
+#define MODEL_FFN_EPSILON 0.0f // SwiGLU outputs below this are flushed to zero, the float32 kernel of w2 skips their multiplications, 0 = exact
+#define MODEL_LAYER0_TABLE 1
+#define MODEL_FOLDED 0
+#define MODEL_CLS_BOUND 1
+#define MODEL_SHORTLIST_MARGIN 0 // sampling leaves out logits this many temperatures below the largest, 0 = off
+#define MODEL_ROWSIZE_DIM 256 // bytes in a weight row of dim elements
+#define MODEL_ROWSIZE_HIDDEN 688 // bytes in a weight row of hidden_dim elements
+#define MODEL_ROWSIZE_FFN 256 // bytes from one w1 row to the next
+#define MODEL_ROWSIZE_CLS_BOUND 76 // bytes in a row of the wcls bound table
+
+// REU addresses
+#define MODEL_TOKEN_EMBEDDING_TABLE 0x000004ul
+#define MODEL_RMS_ATT_WEIGHT 0x020004ul
+#define MODEL_WQ 0x020504ul
+#define MODEL_WK 0x034504ul
+#define MODEL_WV 0x03e504ul
+#define MODEL_WO 0x048504ul
+#define MODEL_RMS_FFN_WEIGHT 0x05c504ul
+#define MODEL_W1 0x05ca04ul
+#define MODEL_W2 0x092604ul
+#define MODEL_W3 0x0c8204ul
+#define MODEL_RMS_FINAL_WEIGHT 0x0fde04ul
+#define MODEL_ROPE 0x0fdf04ul
+#define MODEL_ROPE_COARSE 0x101f04ul
+#define MODEL_WCLS 0x000004ul
+#define MODEL_LAYER0_QKV 0x101f04ul
+#define MODEL_WCLS_BOUND 0x141f04ul
+#define MODEL_REU_END 0x153304ul // first free byte after the weights
+
+// kv cache, right after the weights
+#define MODEL_KEY_CACHE 0x153304ul
+#define MODEL_VALUE_CACHE 0x1a3304ul
+#define MODEL_KV_FORMAT 0
+#define MODEL_KV_LAYER 0x010000ul // bytes of one layer
+#define MODEL_KV_POS 128 // bytes of one position
+#define MODEL_KV_HEAD 32 // bytes of one head at one position
+#define MODEL_KV_SINKS 0 // first positions that are always attended to in streaming mode
+#define MODEL_KV_WINDOW 0 // most recent positions in streaming mode, 0 for a linear cache of seq_len positions
+#define MODEL_KV_SLOTS 512 // positions in the kv cache
+
+// weights and kv cache of every layer, no 32-bit multiplications needed
+const LayerWeights64 model_layers[MODEL_N_LAYERS] = {
+    { 0x020004ul, 0x020504ul, 0x034504ul, 0x03e504ul, 0x048504ul, 0x05c504ul, 0x05ca04ul, 0x092604ul, 0x0c8204ul, 0x153304ul, 0x1a3304ul },
+    { 0x020104ul, 0x024504ul, 0x036504ul, 0x040504ul, 0x04c504ul, 0x05c604ul, 0x067604ul, 0x09d204ul, 0x0d2e04ul, 0x163304ul, 0x1b3304ul },
+    { 0x020204ul, 0x028504ul, 0x038504ul, 0x042504ul, 0x050504ul, 0x05c704ul, 0x072204ul, 0x0a7e04ul, 0x0dda04ul, 0x173304ul, 0x1c3304ul },
+    { 0x020304ul, 0x02c504ul, 0x03a504ul, 0x044504ul, 0x054504ul, 0x05c804ul, 0x07ce04ul, 0x0b2a04ul, 0x0e8604ul, 0x183304ul, 0x1d3304ul },
+    { 0x020404ul, 0x030504ul, 0x03c504ul, 0x046504ul, 0x058504ul, 0x05c904ul, 0x087a04ul, 0x0bd604ul, 0x0f3204ul, 0x193304ul, 0x1e3304ul },
+};
+
+// baked prompt prefixes: tokens, then REU address of x after the last layer at the last position
+// followed by keys and values of all positions for every layer
+#define MODEL_N_PREFIXES 4
+const int16_t model_prefix_tokens[] = {
+    1, 1, 403, 407, 261, 378, 1, 403, 407, 261, 378, 432, 383, 286, 261, 376, 298, 315, 421, 395, 317, 1, 385, 328
+};
+const BakedPrefix64 model_prefixes[MODEL_N_PREFIXES] = {
+    { 1, 0, 0x14b704ul },
+    { 5, 1, 0x14bd04ul },
+    { 15, 6, 0x14d704ul },
+    { 3, 21, 0x152304ul },
+};
+
+// crc32 of config.bin, weights.reu and the lines above
+#define MODEL_CHECKSUM 0x811631d4ul
+
+#endif // MODEL64_H
@@ -10,375 +10,2012 @@
 // ----------------------------------------------------------------------------
 // cache
 
-float *wifbuf; // weight matrix buffer for matmul
-float *xobuf;  // general output buffer for matmul
-float *h1buff;  // buffer for attention heads
-float *h2buff;  // buffer for attention heads
+// the model shape and weights format are constants from model64.h, branches on them fold away
+#define QUANTIZED      (MODEL_WEIGHTS_FORMAT == WEIGHTS_Q8)
+#define BF16           (MODEL_WEIGHTS_FORMAT == WEIGHTS_BF16)
+#define LNS            (MODEL_WEIGHTS_FORMAT == WEIGHTS_LNS)
+#define Q4             (MODEL_WEIGHTS_FORMAT == WEIGHTS_Q4)
+#define GROUPED        (QUANTIZED || LNS || Q4) // rows of bytes followed by one float scale per group
+#define FFN_INTERLEAVE (MODEL_FFN_LAYOUT == FFN_INTERLEAVED)
+#define KV_QUANTIZED   (MODEL_KV_FORMAT == KV_Q8)
+#define MAXDIM         (MODEL_HIDDEN_DIM > MODEL_DIM ? MODEL_HIDDEN_DIM : MODEL_DIM)
+#define GROUPS(n)      (((n) + MODEL_GROUP_SIZE - 1) / MODEL_GROUP_SIZE)
+#define ROW_BYTES(n)   (BF16 ? (n) * 2 : Q4 ? (n) / 2 + GROUPS(n) * 4 : GROUPED ? (n) + GROUPS(n) * 4 : (n) * 4)
+
+// the dot product kernels count elements in 8 bits and the x tables of the float32 one have 256 entries,
+// longer rows of W go in tiles of at most MATMUL_TILE columns, a whole number of groups
+#define MATMUL_TILE    (255 / MODEL_GROUP_SIZE * MODEL_GROUP_SIZE)
+#define TILE_DIM       (MODEL_DIM < MATMUL_TILE ? MODEL_DIM : MATMUL_TILE)
+#define TILE_MAX       (MAXDIM < MATMUL_TILE ? MAXDIM : MATMUL_TILE)
+#define WIFBUF_BYTES   (2 * ROW_BYTES(TILE_DIM) > 4 * TILE_MAX ? 2 * ROW_BYTES(TILE_DIM) : 4 * TILE_MAX)
+#define WIFBUF_SIZE    ((WIFBUF_BYTES > MODEL_ROWSIZE_CLS_BOUND ? WIFBUF_BYTES : MODEL_ROWSIZE_CLS_BOUND) + 3) / 4
+#define XQBUF_SIZE     (MODEL_CLS_BOUND && MODEL_DIM > TILE_MAX ? MODEL_DIM : TILE_MAX)
+
+float wifbuf[WIFBUF_SIZE]; // weight matrix buffer for matmul, fits a tile of a row with its scales, a w1 row with its w3 row, and a tile of x
+float xobuf[MODEL_DIM];    // general output buffer for matmul
+float h2buff[MODEL_HEAD_SIZE]; // buffer for attention heads
+uint8_t kvbuf[MODEL_KV_POS]; // one position of the kv cache
+int8_t hqbuf[MODEL_KV_MUL * MODEL_HEAD_SIZE]; // quantized query heads of one kv head for the int8 kv cache
+float hqscale[MODEL_KV_MUL]; // their scales
+float fcir_sink[MODEL_HEAD_SIZE]; // rope sin/cos at the last kv cache slot, for the attention sinks in streaming mode
+float pfbuf[PREFILL_BATCH * MAXDIM]; // PREFILL_BATCH input vectors of a batched matmul, also fits the int8 vectors with their scales
+float h3buf[MODEL_DIM > MATMUL_TILE ? MODEL_HIDDEN_DIM : 1]; // w3 outputs of the ffn when its rows go in tiles
+
+int8_t xqmem[XQBUF_SIZE];
+float xsmem[GROUPS(TILE_MAX)];
+int8_t *xqbuf = xqmem; // quantized x for int8 matmul, one tile
+float *xsbuf = xsmem;  // scales of xqbuf groups
+uint8_t xgmem[LNS ? TILE_MAX : 1];
+uint8_t *xgbuf = xgmem; // signs of x in log form for LNS weights, the codes are in xqbuf
+
+void rope_table(float* fcir_table, uint16_t pos);
 
 void nnet_init(Transformer* transformer) {
-    Config64* p = transformer->config;
-    uint8_t maxdim = p->hidden_dim;
-    uint8_t dim = p->dim; // 64?
-    uint8_t head_size = dim / p->n_heads;
+    xqbuf = xqmem;
+    xsbuf = xsmem;
+    xgbuf = xgmem;
+    if (MODEL_KV_WINDOW > 0) {
+        rope_table(fcir_sink, MODEL_KV_SLOTS - 1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// activations, see act_t in transformer64.h
+//
+// With MODEL_FIXED_POINT x, the normalized x and hb are Q15.16 fixed-point numbers, so that the
+// residual adds, rmsnorm() and SwiGLU run on integers. The matmul kernels and attention still work
+// on float32, activations are converted only where they go into or come out of them.
+// Products are done on 16-bit operands, shifted right to fit.
 
-    // just in case
-    if (p->dim > maxdim) { maxdim = p->dim; }
-    if (((p->dim * p->n_kv_heads) / p->n_heads) > maxdim) { maxdim = (p->dim * p->n_kv_heads) / p->n_heads; }
+#if MODEL_FIXED_POINT
+#define ACT_ONE 65536l
+
+// Q15.16 from float32, rounded, saturated at +/-32768
+act_t act_from_float(float f) {
+    union { float f; uint32_t i; } u;
+    u.f = f;
+    uint8_t e = (uint8_t)(u.i >> 23); // biased exponent, without the sign
+    if (e < 127 - 17) { return 0; }
+    if (e >= 127 + 15) { return (u.i & 0x80000000ul) ? -0x7fffffffl : 0x7fffffffl; }
+    // f * 2^16 = m * 2^(e-134)
+    uint32_t m = (u.i & 0x7ffffful) | 0x800000ul;
+    int8_t sh = 134 - e;
+    if (sh > 0) {
+        m = (m + ((uint32_t)1 << (sh - 1))) >> sh;
+    } else {
+        m <<= -sh;
+    }
+    return (u.i & 0x80000000ul) ? -(int32_t)m : (int32_t)m;
+}
+
+// float32 of v * 2^e, truncated to 24 bits
+float fix_float(int32_t v, int8_t e) {
+    union { float f; uint32_t i; } u;
+    if (v == 0) { return 0.0; }
+    uint32_t m = v < 0 ? -v : v;
+    int16_t be = 150 + e; // biased exponent for m in [2^23, 2^24)
+    while (m < 0x8000ul) { m <<= 8; be -= 8; }
+    while (m < 0x800000ul) { m <<= 1; be--; }
+    while (m >= 0x1000000ul) { m >>= 1; be++; }
+    u.i = ((uint32_t)be << 23) | (m & 0x7ffffful);
+    if (v < 0) { u.i |= 0x80000000ul; }
+    return u.f;
+}
+
+float act_to_float(act_t v) {
+    return fix_float(v, -16);
+}
+
+// Q15.16 product
+act_t act_mul(act_t a, act_t b) {
+    uint8_t sh = 0;
+    while (a >= 0x8000l || a < -0x8000l) { a >>= 1; sh++; }
+    while (b >= 0x8000l || b < -0x8000l) { b >>= 1; sh++; }
+    int32_t p = (int32_t)(int16_t)a * (int16_t)b;
+    return sh >= 16 ? p << (sh - 16) : p >> (16 - sh);
+}
+#else
+#define act_from_float(f) (f)
+#define act_to_float(v) (v)
+#endif
+
+// convert x in place, for the kernels that take float32
+float* act_to_floats(act_t* x, uint16_t n) {
+    if (MODEL_FIXED_POINT) {
+        float *xf = (float*)x;
+        for (uint16_t i = 0; i < n; i++) {
+            xf[i] = act_to_float(x[i]);
+        }
+    }
+    return (float*)x;
+}
 
-    wifbuf = (float*)malloc(maxdim*sizeof(float));
-    xobuf = (float*)malloc(dim*sizeof(float));
+// convert x in place, for the results of those kernels
+act_t* act_from_floats(float* x, uint16_t n) {
+    if (MODEL_FIXED_POINT) {
+        act_t *xa = (act_t*)x;
+        for (uint16_t i = 0; i < n; i++) {
+            xa[i] = act_from_float(x[i]);
+        }
+    }
+    return (act_t*)x;
+}
 
-    h1buff = (float*)malloc(head_size * sizeof(float));
-    h2buff = (float*)malloc(head_size * sizeof(float));
+// residual connection, y is a matmul output
+void act_add(act_t* x, float* y, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) {
+        x[i] += act_from_float(y[i]);
+    }
 }
 
 // ----------------------------------------------------------------------------
 // neural net blocks; the dynamics of the Transformer
 
-void rmsnorm(float* o, float* x, REUPtr weight, uint8_t size) {
+#if MODEL_FIXED_POINT
+// squares of 15-RMS_SHIFT bits, at most 2^(2*RMS_SHIFT+1) of them fit in the 32-bit sum
+#define RMS_SHIFT (MODEL_DIM <= 512 ? 4 : MODEL_DIM <= 2048 ? 5 : MODEL_DIM <= 8192 ? 6 : MODEL_DIM <= 32768 ? 7 : 8)
+
+void rmsnorm(act_t* o, act_t* x, REUPtr weight, uint16_t size) {
+    // x shifted right by k fits in 16 bits for the products, RMS_SHIFT bits more and the sum of squares fits in 32
+    uint32_t amax = 0;
+    for (uint16_t j = 0; j < size; j++) {
+        uint32_t a = x[j] < 0 ? -x[j] : x[j];
+        if (a > amax) { amax = a; }
+    }
+    uint8_t k = 0;
+    while (amax >= 0x8000ul) { amax >>= 1; k++; }
+    int32_t ss = 0;
+    for (uint16_t j = 0; j < size; j++) {
+        int16_t v = (int16_t)(x[j] >> (k + RMS_SHIFT));
+        ss += (int32_t)v * v;
+    }
+    // one float reciprocal square root per vector
+    float r = fix_float(ss, 2 * (k + RMS_SHIFT) - 32) / size;
+    r += 0.00001;
+    r = 1.0 / sqrt(r);
+    // r = rm * 2^(e-141) with rm in [2^14, 2^15)
+    union { float f; uint32_t i; } u;
+    u.f = r;
+    uint8_t e = (uint8_t)(u.i >> 23);
+    int16_t rm = (int16_t)((((u.i & 0x7ffffful) | 0x800000ul)) >> 9);
+    int8_t sh = 141 - e - k;
+    if (!MODEL_FOLDED) {
+        REU_getf(weight, xobuf, size*sizeof(float));
+    }
+    for (uint16_t j = 0; j < size; j++) {
+        int32_t p = (int32_t)(int16_t)(x[j] >> k) * rm;
+        o[j] = sh >= 0 ? p >> sh : p << -sh;
+        if (!MODEL_FOLDED) {
+            // scale, better fold the gains into the next matrix with --fold-weights
+            o[j] = act_mul(o[j], act_from_float(xobuf[j]));
+        }
+    }
+}
+#else
+void rmsnorm(float* o, float* x, REUPtr weight, uint16_t size) {
     float *wif = xobuf;
     float *xi = x;
     float *oi = o;
     // calculate sum of squares
     float ss = 0.0;
-    for (uint8_t j = 0; j < size; j++) {
+    for (uint16_t j = 0; j < size; j++) {
         ss += (*xi)*(*xi);
         xi++;
     }
     ss /= size;
     ss += 0.00001;
     ss = 1.0 / sqrt(ss);
+    xi = x;
+    if (MODEL_FOLDED) {
+        // only normalize, the gains are in the next matrix
+        for (uint16_t j = 0; j < size; j++) {
+            (*oi) = ss * (*xi);
+            oi++;
+            xi++;
+        }
+        return;
+    }
     // normalize and scale
     REU_getf(weight, xobuf, size*sizeof(float));
-    xi = x;
-    for (uint8_t j = 0; j < size; j++) {
+    for (uint16_t j = 0; j < size; j++) {
         (*oi) = (*wif) * ss * (*xi);
         oi++;
         wif++;
         xi++;
     }
 }
+#endif
 
-// x is remote, size is sampler->vocab_size (uint_16t)
-void softmax(REUPtr x, uint16_t size) {
-    float xif;
-    REUPtr xi;
-    // XXX64 would be faster with local buffer for x[size] to operate here and write back at the end
-    // find max value (for numerical stability)
-    float max_val;
-    xi = x;
-    REU_getf(xi, &max_val, sizeof(float)); // x[0]
-    xi += sizeof(float); // loop below starts with x[1]
-    for (uint16_t i = 1; i < size; i++) {
-        REU_getf(xi, &xif, sizeof(float));
-        if (xif > max_val) {
-            max_val = xif;
+// ----------------------------------------------------------------------------
+// int8 dot product kernel in 6502 assembly
+//
+// Quarter-square multiply: a*b = f(a+b) - f(a-b) with f(n) = n*n/4 (rounded down, the
+// fractions cancel). a and b are biased to a+128 and b+128 so that they can index the
+// tables, for each product the biased a goes into the low byte of four zero page pointers
+// into page-aligned tables and the biased b (or its complement) is the index register.
+// The f(a+b) and f(a-b) are summed separately and subtracted once at the end.
+
+uint8_t qsq_plus_lo[512];  // f(i-256), for a+b = (a+128)+(b+128)-256
+uint8_t qsq_plus_hi[512];
+uint8_t qsq_minus_lo[512]; // f(i-255), for a-b = (a+128)+(255-(b+128))-255
+uint8_t qsq_minus_hi[512];
+#pragma align(qsq_plus_lo, 256)
+#pragma align(qsq_plus_hi, 256)
+#pragma align(qsq_minus_lo, 256)
+#pragma align(qsq_minus_hi, 256)
+
+__zeropage uint8_t *qm_pl, *qm_ph, *qm_ml, *qm_mh; // table pointers, the low byte is set for each product
+__zeropage int8_t *qm_wp, *qm_xp; // the two vectors
+__zeropage uint8_t qm_j;          // index of the current element
+__zeropage uint32_t qm_psum, qm_msum; // sums of f(a+b) and f(a-b), 24 bits are enough for 255 products
+
+void qsq_init(void) {
+    // f(n+1) = f(n) + (n+1)/2, both tables are symmetric around f(0)
+    uint16_t f = 0;
+    for (uint16_t n = 0; n <= 256; n++) {
+        qsq_plus_lo[256 - n] = (uint8_t)f;
+        qsq_plus_hi[256 - n] = (uint8_t)(f >> 8);
+        if (n < 256) {
+            qsq_plus_lo[256 + n] = (uint8_t)f;
+            qsq_plus_hi[256 + n] = (uint8_t)(f >> 8);
+            qsq_minus_lo[255 - n] = (uint8_t)f;
+            qsq_minus_hi[255 - n] = (uint8_t)(f >> 8);
         }
-        xi += sizeof(float);
+        qsq_minus_lo[255 + n] = (uint8_t)f;
+        qsq_minus_hi[255 + n] = (uint8_t)(f >> 8);
+        f += (n + 1) >> 1;
     }
-    // exp and sum
-    float sum = 0.0;
-    xi = x;
-    for (uint16_t i = 0; i < size; i++) {
-        REU_getf(xi, &xif, sizeof(float));
-        xif = my_exp(xif - max_val);
-        REU_putf(xi, &xif, sizeof(float)); // write back locally changed
-        sum += xif;
-        xi += sizeof(float);
-    }
-    // normalize
-    xi = x;
-    for (uint16_t i = 0; i < size; i++) {
-        REU_getf(xi, &xif, sizeof(float));
-        xif /= sum;
-        REU_putf(xi, &xif, sizeof(float)); // write back locally changed
-        xi += sizeof(float);
+}
+
+// sum of w[j]*x[j] for j=0..n-1, n > 0
+int32_t i8_dot(int8_t* w, int8_t* x, uint8_t n) {
+    qm_pl = qsq_plus_lo;
+    qm_ph = qsq_plus_hi;
+    qm_ml = qsq_minus_lo;
+    qm_mh = qsq_minus_hi;
+    qm_wp = w;
+    qm_xp = x;
+    qm_j = n;
+    qm_psum = 0;
+    qm_msum = 0;
+    __asm {
+        ldy qm_j
+    elem:
+        dey
+        sty qm_j
+        // a + 128 selects the table entries
+        lda (qm_xp), y
+        eor #$80
+        sta qm_pl
+        sta qm_ph
+        sta qm_ml
+        sta qm_mh
+        // b + 128 indexes them for f(a+b)
+        lda (qm_wp), y
+        eor #$80
+        tay
+        clc
+        lda (qm_pl), y
+        adc qm_psum
+        sta qm_psum
+        lda (qm_ph), y
+        adc qm_psum + 1
+        sta qm_psum + 1
+        bcc pdone
+        inc qm_psum + 2
+    pdone:
+        // 255 - (b + 128) for f(a-b)
+        tya
+        eor #$ff
+        tay
+        clc
+        lda (qm_ml), y
+        adc qm_msum
+        sta qm_msum
+        lda (qm_mh), y
+        adc qm_msum + 1
+        sta qm_msum + 1
+        bcc mdone
+        inc qm_msum + 2
+    mdone:
+        ldy qm_j
+        bne elem
     }
+    return (int32_t)(qm_psum - qm_msum);
 }
 
-// xout is remote, x is local, w is remote, n/d are always dim
-void matmul(REUPtr xout, float* x, REUPtr w, uint8_t n, uint8_t d) {
-    // W (d,n) @ x (n,) -> xout (d,)
-    // by far the most amount of time is spent inside this little function
-    float *xof = xobuf;
-    float *wif;
-    float *xi;
-    for (uint8_t i = 0; i < d; i++) {
-        (*xof) = 0.0;
-        xi = x;
-        REU_getf(w, wifbuf, n*sizeof(float));
-        w += n*sizeof(float);
-        wif = wifbuf;
-        for (uint8_t j = 0; j < n; j++) {
-            (*xof) += (*wif) * (*xi);
-            wif++;
-            xi++;
+// ----------------------------------------------------------------------------
+// int8 group-quantized weights (Q8_0), see generate-model-files.py --quantize q8
+
+// quantize a group of len values of x into xq, returns the scale
+float quantize_group(int8_t* xq, float* x, uint16_t len) {
+    // find the max absolute value in this group
+    float wmax = 0.0;
+    for (uint16_t j = 0; j < len; j++) {
+        float val = fabs(x[j]);
+        if (val > wmax) { wmax = val; }
+    }
+    // calculate the scaling factor
+    float scale = wmax / 127.0;
+    float iscale = (scale != 0.0) ? 1.0 / scale : 0.0;
+    // round to the nearest int8
+    for (uint16_t j = 0; j < len; j++) {
+        float val = (*x) * iscale;
+        (*xq) = (int8_t)(val < 0.0 ? val - 0.5 : val + 0.5);
+        xq++;
+        x++;
+    }
+    return scale;
+}
+
+// quantize x into xqbuf/xsbuf, once per matmul call (or tile)
+void quantize_x(float* x, uint8_t n) {
+    float *xi = x;
+    int8_t *xq = xqbuf;
+    float *xs = xsbuf;
+    uint8_t left = n;
+    while (left > 0) {
+        uint8_t len = left < MODEL_GROUP_SIZE ? left : MODEL_GROUP_SIZE;
+        (*xs) = quantize_group(xq, xi, len);
+        xs++;
+        xq += len;
+        xi += len;
+        left -= len;
+    }
+}
+
+// dot product of a row of W (n int8 values followed by one float scale per group) with xqbuf/xsbuf, added to val
+float q8_dot(int8_t* wq, uint8_t n, float val) {
+    float *ws = (float*)(wq + n);
+    int8_t *xq = xqbuf;
+    float *xs = xsbuf;
+    uint8_t left = n;
+    while (left > 0) {
+        uint8_t len = left < MODEL_GROUP_SIZE ? left : MODEL_GROUP_SIZE;
+        // integer dot product of one group
+        int32_t ival = i8_dot(wq, xq, len);
+        wq += len;
+        xq += len;
+        // one float rescale per group
+        val += ((float)ival) * (*ws) * (*xs);
+        ws++;
+        xs++;
+        left -= len;
+    }
+    return val;
+}
+
+// widen n bfloat16 values at the start of o into float32, in place
+void bf16_widen(float* o, uint16_t n) {
+    uint16_t *b = (uint16_t*)o;
+    for (uint16_t j = n; j > 0; j--) {
+        uint16_t *h = (uint16_t*)(o + j - 1);
+        h[1] = b[j - 1];
+        h[0] = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// 4-bit group-quantized weights (Q4), see generate-model-files.py --quantize q4
+//
+// Two weights in a byte, the low nibble is weight j of a group and the high nibble weight
+// j + len/2, so that a group unpacks into two runs of consecutive int8 values in one pass.
+// Those go through i8_dot() with x quantized like for int8 weights, the scales are like Q8_0.
+
+int8_t q4_lo[Q4 ? 256 : 1]; // low nibble of a byte, sign extended
+int8_t q4_hi[Q4 ? 256 : 1]; // high nibble
+int8_t q4buf[Q4 ? MODEL_GROUP_SIZE : 1]; // one group unpacked
+#pragma align(q4_lo, 256)
+#pragma align(q4_hi, 256)
+
+__zeropage uint8_t *q4_wp;        // packed group
+__zeropage int8_t *q4_lp, *q4_hp; // its two halves in q4buf
+__zeropage uint8_t q4_h;          // bytes in the group
+
+void q4_init(void) {
+    for (uint16_t b = 0; b < 256; b++) {
+        q4_lo[b] = (int8_t)(uint8_t)(b << 4) >> 4;
+        q4_hi[b] = (int8_t)(uint8_t)b >> 4;
+    }
+}
+
+// unpack the h bytes of a group at w into q4buf, in 6502 assembly
+void q4_unpack(uint8_t* w, uint8_t h) {
+    q4_wp = w;
+    q4_lp = q4buf;
+    q4_hp = q4buf + h;
+    q4_h = h;
+    __asm {
+        ldy q4_h
+    pair:
+        dey
+        lda (q4_wp), y
+        tax
+        lda q4_lo, x
+        sta (q4_lp), y
+        lda q4_hi, x
+        sta (q4_hp), y
+        tya
+        bne pair
+    }
+}
+
+// dot product of a row of W (n/2 bytes followed by one float scale per group) with xqbuf/xsbuf, added to val
+float q4_dot(uint8_t* w, uint8_t n, float val) {
+    float *ws = (float*)(w + n / 2);
+    int8_t *xq = xqbuf;
+    float *xs = xsbuf;
+    uint8_t left = n;
+    while (left > 0) {
+        uint8_t len = left < MODEL_GROUP_SIZE ? left : MODEL_GROUP_SIZE;
+        q4_unpack(w, len / 2);
+        int32_t ival = i8_dot(q4buf, xq, len);
+        w += len / 2;
+        xq += len;
+        // one float rescale per group
+        val += ((float)ival) * (*ws) * (*xs);
+        ws++;
+        xs++;
+        left -= len;
+    }
+    return val;
+}
+
+// ----------------------------------------------------------------------------
+// log-number-system weights (LNS), see generate-model-files.py --quantize lns
+//
+// A weight is a sign (bit 7) and a 7-bit code m for the magnitude s*lns_exp(m), where
+// lns_exp(m) = 16384*2^(-m/16) and s is one float scale per group, like Q8_0.
+// lns_prepare_x() turns x into codes of the same kind once per matmul, relative to the
+// largest value of each group, so that a product is the sum of two codes and one lookup
+// in the antilog table, which is 0 past the largest possible sum. Codes of x go up to 127,
+// values too small for that get 255, then the sum with any weight code but 0 carries out.
+
+uint8_t lns_lo[LNS ? 256 : 1]; // lns_exp(m) for m=0..254, 0 for 255
+uint8_t lns_hi[LNS ? 256 : 1];
+uint8_t lns_log[LNS ? 128 : 1]; // 16*log2(1+m/128), rounded
+float lns_frac[LNS ? 16 : 1];   // 2^(k/16)
+#pragma align(lns_lo, 256)
+#pragma align(lns_hi, 256)
+
+__zeropage uint8_t *lw_wp, *lw_xm, *lw_xg; // weights, x codes and x signs of a group
+__zeropage uint8_t lw_n;    // elements left
+__zeropage uint8_t lw_ws;   // sign of the current weight
+__zeropage uint32_t lw_acc; // sum of the products, 24 bits are enough for 255 of them
+
+void lns_init(void) {
+    for (uint8_t m = 0; m < 255; m++) {
+        uint16_t v = (uint16_t)(16384.0 * my_exp_poly(m * (-0.69314718056 / 16.0)) + 0.5);
+        lns_lo[m] = (uint8_t)v;
+        lns_hi[m] = (uint8_t)(v >> 8);
+    }
+    lns_lo[255] = 0;
+    lns_hi[255] = 0;
+    for (uint8_t k = 0; k < 16; k++) {
+        lns_frac[k] = my_exp_poly(k * (0.69314718056 / 16.0));
+    }
+    // number of steps l/16 + 1/32 below log2(1+m/128)
+    uint8_t l = 0;
+    for (uint8_t m = 0; m < 128; m++) {
+        float v = 1.0 + m / 128.0;
+        while (l < 16 && v >= my_exp_poly((l + 0.5) * (0.69314718056 / 16.0))) { l++; }
+        lns_log[m] = l;
+    }
+}
+
+// 16*log2|x| + 16*127 from the exponent and the top 7 mantissa bits, 0 for zero
+uint16_t lns_log2(uint8_t* xb) {
+    uint8_t e = (xb[3] << 1) | (xb[2] >> 7);
+    return e ? ((uint16_t)e << 4) + lns_log[xb[2] & 0x7f] : 0;
+}
+
+// x into log form in xqbuf (codes), xgbuf (signs) and xsbuf (group scales), once per matmul call (or tile)
+void lns_prepare_x(float* x, uint8_t n) {
+    uint8_t *xb = (uint8_t*)x;
+    uint8_t *xm = (uint8_t*)xqbuf;
+    uint8_t *xg = xgbuf;
+    float *xs = xsbuf;
+    uint8_t left = n;
+    while (left > 0) {
+        uint8_t len = left < MODEL_GROUP_SIZE ? left : MODEL_GROUP_SIZE;
+        uint16_t lmax = 0;
+        for (uint8_t j = 0; j < len; j++) {
+            uint16_t l = lns_log2(xb + j * sizeof(float));
+            if (l > lmax) { lmax = l; }
+        }
+        for (uint8_t j = 0; j < len; j++) {
+            uint16_t l = lns_log2(xb);
+            (*xm) = (l == 0 || lmax - l > 127) ? 255 : (uint8_t)(lmax - l);
+            (*xg) = xb[3] & 0x80;
+            xm++;
+            xg++;
+            xb += sizeof(float);
         }
-        xof++;
+        // 2^(lmax/16 - 127), 2^(k/16) has the exponent of 1.0
+        union { float f; uint32_t i; } u;
+        u.f = lns_frac[lmax & 15];
+        u.i = (u.i & 0x807ffffful) | ((uint32_t)(lmax >> 4) << 23);
+        (*xs) = lmax ? u.f : 0.0;
+        xs++;
+        left -= len;
     }
-    REU_putf(xout, xobuf, d*sizeof(float));
 }
 
-// xout is local, x is local, w is remote, n/d are always dim/hidden_dim
-void matmul_l(float* xout, float* x, REUPtr w, uint8_t n, uint8_t d) {
+// sum of the n products of weight and x codes, in 6502 assembly
+int32_t lns_group_dot(uint8_t* w, uint8_t* xm, uint8_t* xg, uint8_t n) {
+    lw_wp = w;
+    lw_xm = xm;
+    lw_xg = xg;
+    lw_n = n;
+    lw_acc = 0;
+    __asm {
+        ldy lw_n
+    elem:
+        dey
+        lda (lw_wp), y
+        sta lw_ws
+        and #$7f
+        clc
+        adc (lw_xm), y      // product code, carry out for small x
+        bcs next
+        tax
+        lda (lw_xg), y
+        eor lw_ws
+        bmi neg
+        clc
+        lda lw_acc
+        adc lns_lo, x
+        sta lw_acc
+        lda lw_acc + 1
+        adc lns_hi, x
+        sta lw_acc + 1
+        bcc next
+        inc lw_acc + 2
+        bcs next            // always
+    neg:
+        sec
+        lda lw_acc
+        sbc lns_lo, x
+        sta lw_acc
+        lda lw_acc + 1
+        sbc lns_hi, x
+        sta lw_acc + 1
+        bcs next
+        dec lw_acc + 2
+    next:
+        tya
+        bne elem
+    }
+    return (int32_t)(lw_acc << 8) >> 8;
+}
+
+// dot product of a row of W (n sign/code bytes followed by one float scale per group) with x from lns_prepare_x(), added to val
+float lns_dot(uint8_t* w, uint8_t n, float val) {
+    float *ws = (float*)(w + n);
+    uint8_t *xm = (uint8_t*)xqbuf;
+    uint8_t *xg = xgbuf;
+    float *xs = xsbuf;
+    uint8_t left = n;
+    while (left > 0) {
+        uint8_t len = left < MODEL_GROUP_SIZE ? left : MODEL_GROUP_SIZE;
+        int32_t ival = lns_group_dot(w, xm, xg, len);
+        w += len;
+        xm += len;
+        xg += len;
+        // one float rescale per group
+        val += ((float)ival) * (*ws) * (*xs);
+        ws++;
+        xs++;
+        left -= len;
+    }
+    return val;
+}
+
+// ----------------------------------------------------------------------------
+// float32 dot product kernel in 6502 assembly
+//
+// Exact IEEE float32 round-to-nearest-even multiply and add, same results as
+// (*xo) += (*wif) * (*xi) done in a loop, except that denormals are flushed to zero.
+// Products and sums that overflow become infinity and stay there (inf - inf is not NaN).
+// The x vector is shared by all rows of W, so fdot_prepare() unpacks it once per
+// matmul into sign/exponent/mantissa tables, and the accumulator stays unpacked
+// until the end of the row. Only the weights are unpacked for every product.
+// The sum starts from a given float32, the one of the previous tile of a long row.
+// Weights can also be bfloat16, the upper half of a float32: their 8 mantissa bits
+// need only 8 rounds of the multiply loop, with the same exact product.
+
+uint8_t fd_xs[256];  // x sign (bit 7)
+uint8_t fd_xe[256];  // x biased exponent, 0 for zero (and flushed denormals)
+uint8_t fd_xm0[256]; // x mantissa, low byte
+uint8_t fd_xm1[256]; // x mantissa, middle byte
+uint8_t fd_xm2[256]; // x mantissa, high byte with the implicit 1 bit
+
+__zeropage uint8_t *fd_wp;   // current weight, its upper mantissa byte at offset 2
+__zeropage uint8_t fd_wsz;   // size of a weight, 4 for float32 or 2 for bfloat16
+__zeropage uint8_t fd_n;     // index of the last x element + 1
+__zeropage uint8_t fd_xi;    // index of the first x element
+__zeropage uint8_t fd_x0, fd_x1, fd_x2;  // x mantissa of the current element
+__zeropage uint8_t fd_p0, fd_p1, fd_p2, fd_p3, fd_p4, fd_p5; // 48 bit mantissa product
+__zeropage uint8_t fd_ps, fd_pe, fd_ph;  // product sign and exponent, fd_ph is its high byte (-1..2)
+__zeropage uint8_t fd_as, fd_ae, fd_a0, fd_a1, fd_a2; // unpacked accumulator
+__zeropage uint8_t fd_r0, fd_r1, fd_r2, fd_r3, fd_rs, fd_re; // larger addend, 24 bits + guard byte
+__zeropage uint8_t fd_t0, fd_t1, fd_t2, fd_t3, fd_te; // smaller addend, aligned to fd_r
+__zeropage uint8_t fd_st;    // sticky bit for alignment shifts
+float fd_res;                // packed initial sum, then the result
+
+// unpack x of float32 (xsz 4) or bfloat16 (xsz 2) for the following fdot() calls
+void fdot_prepare_row(uint8_t* x, uint8_t xsz, uint8_t n) {
+    uint8_t *xb = x + xsz - 4;
+    for (uint8_t j = 0; j < n; j++) {
+        uint8_t e = (xb[3] << 1) | (xb[2] >> 7);
+        fd_xs[j] = xb[3] & 0x80;
+        fd_xe[j] = (e == 0xff) ? 0xfe : e; // there are no inf/nan in activations
+        fd_xm2[j] = xb[2] | 0x80;
+        fd_xm1[j] = xsz == 4 ? xb[1] : 0;
+        fd_xm0[j] = xsz == 4 ? xb[0] : 0;
+        xb += xsz;
+    }
+}
+
+void fdot_prepare(float* x, uint8_t n) {
+    fdot_prepare_row((uint8_t*)x, 4, n);
+}
+
+// acc + sum of w[j]*x[xi+j] for j=0..n-1, w of float32 (wsz 4) or bfloat16 (wsz 2), x from the last fdot_prepare()
+float fdot_row(uint8_t* w, uint8_t wsz, uint8_t xi, uint8_t n, float acc) {
+    fd_wp = w + wsz - 4;
+    fd_wsz = wsz;
+    fd_xi = xi;
+    fd_n = xi + n;
+    fd_res = acc;
+    __asm {
+        // unpack acc into the accumulator, exponent 0 is zero
+        lda fd_res + 3
+        and #$80
+        sta fd_as
+        lda fd_res + 2
+        asl                 // C = exponent lsb
+        lda fd_res + 3
+        rol
+        sta fd_ae
+        lda fd_res + 2
+        ora #$80
+        sta fd_a2
+        lda fd_res + 1
+        sta fd_a1
+        lda fd_res
+        sta fd_a0
+        ldx fd_xi           // x = element index
+    elem:
+        // unpack w exponent, skip zero products
+        ldy #2
+        lda (fd_wp), y
+        sta fd_p2           // mantissa high byte, implicit 1 set below
+        asl                 // C = exponent lsb
+        iny
+        lda (fd_wp), y
+        rol                 // A = exponent
+        bne wnz
+        jmp next
+    wnz:
+        ldy fd_xe, x
+        bne xnz
+        jmp next
+    xnz:
+        // product exponent ew + ex - 127 in fd_ph:fd_pe, normalizing and rounding add up to 2
+        // so under- and overflow are only known after that, below -1 it can't reach 1 anymore
+        ldy #0
+        clc
+        adc fd_xe, x
+        bcc esum
+        iny
+    esum:
+        sec
+        sbc #127
+        bcs eok
+        dey
+        bpl eok
+        cmp #$ff
+        beq eok
+        jmp next
+    eok:
+        sta fd_pe
+        sty fd_ph
+        ldy #3
+        lda (fd_wp), y
+        eor fd_xs, x
+        and #$80
+        sta fd_ps
+        // multiplier: w mantissa in the low half of the product, y = rounds
+        lda fd_p2
+        ora #$80
+        ldy fd_wsz
+        cpy #4
+        bne wbf16
+        sta fd_p2
+        ldy #1
+        lda (fd_wp), y
+        sta fd_p1
+        dey
+        lda (fd_wp), y
+        sta fd_p0
+        ldy #24
+        bne wmul
+    wbf16:
+        // 8 bit mantissa, after 8 rounds the product is in the same place as after 24
+        sta fd_p0
+        lda #0
+        sta fd_p1
+        sta fd_p2
+        ldy #8
+    wmul:
+        // multiplicand: pre-decomposed x mantissa
+        lda fd_xm0, x
+        sta fd_x0
+        lda fd_xm1, x
+        sta fd_x1
+        lda fd_xm2, x
+        sta fd_x2
+        // 24x24 bit shift and add multiply
+        lda #0
+        sta fd_p3
+        sta fd_p4
+        sta fd_p5
+        lsr fd_p2
+        ror fd_p1
+        ror fd_p0
+    mloop:
+        bcc mnoadd
+        clc
+        lda fd_p3
+        adc fd_x0
+        sta fd_p3
+        lda fd_p4
+        adc fd_x1
+        sta fd_p4
+        lda fd_p5
+        adc fd_x2
+        sta fd_p5
+    mnoadd:
+        ror fd_p5
+        ror fd_p4
+        ror fd_p3
+        ror fd_p2
+        ror fd_p1
+        ror fd_p0
+        dey
+        bne mloop
+        // normalize product to 1.xxx, bits 47..24
+        lda fd_p5
+        bmi ptop
+        asl fd_p0
+        rol fd_p1
+        rol fd_p2
+        rol fd_p3
+        rol fd_p4
+        rol fd_p5
+        jmp pround
+    ptop:
+        inc fd_pe
+        bne pround
+        inc fd_ph
+    pround:
+        // round to nearest even, p2 is the guard byte, p1/p0 are sticky
+        lda fd_p1
+        ora fd_p0
+        beq pnost
+        lda fd_p2
+        ora #1
+        sta fd_p2
+    pnost:
+        lda fd_p2
+        cmp #$80
+        bcc pdone
+        bne pup
+        lda fd_p3
+        and #1
+        beq pdone
+    pup:
+        inc fd_p3
+        bne pdone
+        inc fd_p4
+        bne pdone
+        inc fd_p5
+        bne pdone
+        lda #$80
+        sta fd_p5
+        inc fd_pe
+        bne pdone
+        inc fd_ph
+    pdone:
+        // exponent below 1: flush to zero, above 254: infinity
+        lda fd_ph
+        bmi pzero
+        bne pinf
+        lda fd_pe
+        beq pzero
+        cmp #$ff
+        bne pnorm
+    pinf:
+        lda #$ff
+        sta fd_pe
+        lda #$80
+        sta fd_p5
+        lda #0
+        sta fd_p4
+        sta fd_p3
+        beq pnorm
+    pzero:
+        jmp next
+    pnorm:
+        // accumulator is zero: take the product as is
+        lda fd_ae
+        bne asum
+        lda fd_ps
+        sta fd_as
+        lda fd_pe
+        sta fd_ae
+        lda fd_p5
+        sta fd_a2
+        lda fd_p4
+        sta fd_a1
+        lda fd_p3
+        sta fd_a0
+        jmp next
+    asum:
+        // r = the larger magnitude, t = the smaller one
+        cmp fd_pe
+        bne acmp
+        lda fd_a2
+        cmp fd_p5
+        bne acmp
+        lda fd_a1
+        cmp fd_p4
+        bne acmp
+        lda fd_a0
+        cmp fd_p3
+    acmp:
+        bcc pbig
+        lda fd_as
+        sta fd_rs
+        lda fd_ae
+        sta fd_re
+        lda fd_a2
+        sta fd_r3
+        lda fd_a1
+        sta fd_r2
+        lda fd_a0
+        sta fd_r1
+        lda fd_pe
+        sta fd_te
+        lda fd_p5
+        sta fd_t3
+        lda fd_p4
+        sta fd_t2
+        lda fd_p3
+        sta fd_t1
+        jmp align
+    pbig:
+        lda fd_ps
+        sta fd_rs
+        lda fd_pe
+        sta fd_re
+        lda fd_p5
+        sta fd_r3
+        lda fd_p4
+        sta fd_r2
+        lda fd_p3
+        sta fd_r1
+        lda fd_ae
+        sta fd_te
+        lda fd_a2
+        sta fd_t3
+        lda fd_a1
+        sta fd_t2
+        lda fd_a0
+        sta fd_t1
+    align:
+        // infinity absorbs anything smaller
+        lda fd_re
+        cmp #$ff
+        bne afin
+        jmp adone
+    afin:
+        lda #0
+        sta fd_r0
+        sta fd_t0
+        sta fd_st
+        // shift t right by the exponent difference, sticky bits jammed into bit 0
+        lda fd_re
+        sec
+        sbc fd_te
+        cmp #32
+        bcc abytes
+        lda #0
+        sta fd_t3
+        sta fd_t2
+        sta fd_t1
+        lda #1
+        sta fd_t0
+        jmp aligned
+    abytes:
+        cmp #8
+        bcc abits
+        tay
+        lda fd_t0
+        ora fd_st
+        sta fd_st
+        lda fd_t1
+        sta fd_t0
+        lda fd_t2
+        sta fd_t1
+        lda fd_t3
+        sta fd_t2
+        lda #0
+        sta fd_t3
+        tya
+        sbc #8              // C is set
+        jmp abytes
+    abits:
+        tay
+        beq ajam
+    abit:
+        lsr fd_t3
+        ror fd_t2
+        ror fd_t1
+        ror fd_t0
+        bcc abit1
+        lda #1
+        sta fd_st
+    abit1:
+        dey
+        bne abit
+    ajam:
+        lda fd_st
+        beq aligned
+        lda fd_t0
+        ora #1
+        sta fd_t0
+    aligned:
+        lda fd_ps
+        eor fd_as
+        bmi asub
+        // same signs: r += t
+        clc
+        lda fd_r0
+        adc fd_t0
+        sta fd_r0
+        lda fd_r1
+        adc fd_t1
+        sta fd_r1
+        lda fd_r2
+        adc fd_t2
+        sta fd_r2
+        lda fd_r3
+        adc fd_t3
+        sta fd_r3
+        bcc around
+        ror fd_r3
+        ror fd_r2
+        ror fd_r1
+        ror fd_r0
+        bcc ainc
+        lda fd_r0
+        ora #1
+        sta fd_r0
+    ainc:
+        inc fd_re
+        lda fd_re
+        cmp #$ff
+        bne around
+        jmp adone           // overflow, infinity
+    asub:
+        // different signs: r -= t, then normalize
+        sec
+        lda fd_r0
+        sbc fd_t0
+        sta fd_r0
+        lda fd_r1
+        sbc fd_t1
+        sta fd_r1
+        lda fd_r2
+        sbc fd_t2
+        sta fd_r2
+        lda fd_r3
+        sbc fd_t3
+        sta fd_r3
+        bmi around
+        ora fd_r2
+        ora fd_r1
+        ora fd_r0
+        beq azero
+    anorm:
+        dec fd_re
+        beq azero
+        asl fd_r0
+        rol fd_r1
+        rol fd_r2
+        rol fd_r3
+        bpl anorm
+    around:
+        // round to nearest even, r0 is the guard byte
+        lda fd_r0
+        cmp #$80
+        bcc adone
+        bne aup
+        lda fd_r1
+        and #1
+        beq adone
+    aup:
+        inc fd_r1
+        bne adone
+        inc fd_r2
+        bne adone
+        inc fd_r3
+        bne adone
+        lda #$80
+        sta fd_r3
+        inc fd_re
+    adone:
+        // exponent 255 is infinity, with a zero mantissa
+        lda fd_re
+        cmp #$ff
+        bne afinite
+        lda #$80
+        sta fd_r3
+        lda #0
+        sta fd_r2
+        sta fd_r1
+    afinite:
+        lda fd_rs
+        sta fd_as
+        lda fd_re
+        sta fd_ae
+        lda fd_r3
+        sta fd_a2
+        lda fd_r2
+        sta fd_a1
+        lda fd_r1
+        sta fd_a0
+        jmp next
+    azero:
+        lda #0
+        sta fd_ae
+    next:
+        clc
+        lda fd_wp
+        adc fd_wsz
+        sta fd_wp
+        bcc nextw
+        inc fd_wp + 1
+    nextw:
+        inx
+        cpx fd_n
+        beq pack
+        jmp elem
+    pack:
+        // pack the accumulator into float32
+        lda fd_ae
+        bne packnz
+        sta fd_res
+        sta fd_res + 1
+        sta fd_res + 2
+        sta fd_res + 3
+        jmp done
+    packnz:
+        lsr
+        ora fd_as
+        sta fd_res + 3
+        lda fd_a2
+        and #$7f
+        bcc packe
+        ora #$80
+    packe:
+        sta fd_res + 2
+        lda fd_a1
+        sta fd_res + 1
+        lda fd_a0
+        sta fd_res
+    done:
+    }
+    return fd_res;
+}
+
+float fdot_from(float* w, uint8_t xi, uint8_t n) {
+    return fdot_row((uint8_t*)w, 4, xi, n, 0.0);
+}
+
+// acc + sum of w[j]*x[j] for j=0..n-1, x from the last fdot_prepare()
+float fdot(float* w, uint8_t n, float acc) {
+    return fdot_row((uint8_t*)w, 4, 0, n, acc);
+}
+
+// same for bfloat16 w
+float bf16_dot(uint16_t* w, uint8_t n, float acc) {
+    return fdot_row((uint8_t*)w, 2, 0, n, acc);
+}
+
+// ----------------------------------------------------------------------------
+// matmuls, quantized weights use the int8 kernels above
+//
+// Rows longer than MATMUL_TILE go in tiles: x is prepared for one tile at a time, every row
+// fetches only that part of it and its dot product goes on from the sum of the previous tiles,
+// so the results are the same as with whole rows.
+
+// prepare x of at most MATMUL_TILE elements as the shared operand of the following row_dot() calls
+void tile_prepare(float* x, uint8_t n) {
+    if (QUANTIZED || Q4) {
+        quantize_x(x, n);
+    } else if (LNS) {
+        lns_prepare_x(x, n);
+    } else {
+        fdot_prepare(x, n);
+    }
+}
+
+// prepare x as the shared operand of the following matmul_rows() calls,
+// matmul_rows() prepares the tiles of a longer x itself
+void matmul_prepare(float* x, uint16_t n) {
+    if (n <= MATMUL_TILE) {
+        tile_prepare(x, n);
+    }
+}
+
+// size in bytes of a row of n weights, same as weight_row_size()
+uint16_t row_size(uint16_t n) {
+    return ROW_BYTES(n);
+}
+
+// fetch columns c..c+len-1 of a remote row of n weights into buf, packed like a row of len weights
+void tile_fetch(float* buf, REUPtr row, uint16_t n, uint16_t c, uint8_t len) {
+    if (len == n) {
+        REU_getf(row, buf, row_size(n));
+    } else if (GROUPED) {
+        // the weights, then the scales of their groups from the end of the row
+        uint8_t wsize = Q4 ? len / 2 : len;
+        REU_getf(row + (Q4 ? c / 2 : c), buf, wsize);
+        REU_getf(row + (Q4 ? n / 2 : n) + c / MODEL_GROUP_SIZE * sizeof(float), (float*)((uint8_t*)buf + wsize), GROUPS(len) * sizeof(float));
+    } else {
+        REU_getf(row + c * (BF16 ? sizeof(uint16_t) : sizeof(float)), buf, row_size(len));
+    }
+}
+
+// dot product of a local row (or tile) of W with x given to tile_prepare(), added to acc
+float row_dot(float* w, uint8_t n, float acc) {
+    if (BF16) { return bf16_dot((uint16_t*)w, n, acc); }
+    if (LNS) { return lns_dot((uint8_t*)w, n, acc); }
+    if (Q4) { return q4_dot((uint8_t*)w, n, acc); }
+    return QUANTIZED ? q8_dot((int8_t*)w, n, acc) : fdot(w, n, acc);
+}
+
+// xout is local, x is local and was given to matmul_prepare(), w is remote with rows stride bytes apart, d up to vocab_size
+void matmul_rows(float* xout, float* x, REUPtr w, uint16_t stride, uint16_t n, uint16_t d) {
     // W (d,n) @ x (n,) -> xout (d,)
     // by far the most amount of time is spent inside this little function
-    float *xo = xout;
-    float *wif;
-    float *xi;
-    for (uint8_t i = 0; i < d; i++) {
-        (*xo) = 0.0;
-        xi = x;
-        REU_getf(w, wifbuf, n*sizeof(float));
-        w += n*sizeof(float);
-        wif = wifbuf;
-        for (uint8_t j = 0; j < n; j++) {
-            (*xo) += (*wif) * (*xi);
-            wif++;
-            xi++;
+    for (uint16_t c = 0; c < n; c += MATMUL_TILE) {
+        uint8_t len = n - c < MATMUL_TILE ? n - c : MATMUL_TILE;
+        if (len < n) {
+            tile_prepare(x + c, len);
+        }
+        REUPtr wr = w;
+        float *xo = xout;
+        for (uint16_t i = 0; i < d; i++) {
+            tile_fetch(wifbuf, wr, n, c, len);
+            wr += stride;
+            (*xo) = row_dot(wifbuf, len, c > 0 ? (*xo) : 0.0);
+            xo++;
         }
-        xo++;
     }
 }
 
+// xout is local, x is local, w is remote, n/d are always dim/hidden_dim
+void matmul_l(float* xout, float* x, REUPtr w, uint16_t n, uint16_t d) {
+    matmul_prepare(x, n);
+    matmul_rows(xout, x, w, row_size(n), n, d);
+}
+
 // xout is local, x is local, w is remote, n/d are always dim/vocab_size
-void matmul_ll(float* xout, float* x, REUPtr w, uint8_t n, uint16_t d) {
-    // W (d,n) @ x (n,) -> xout (d,)
-    // by far the most amount of time is spent inside this little function
-    float *xo = xout;
-    float *wif;
-    float *xi;
-    for (uint16_t i = 0; i < d; i++) {
-        (*xo) = 0.0;
-        xi = x;
-        REU_getf(w, wifbuf, n*sizeof(float));
-        w += n*sizeof(float);
-        wif = wifbuf;
-        for (uint8_t j = 0; j < n; j++) {
-            (*xo) += (*wif) * (*xi);
-            wif++;
-            xi++;
+void matmul_ll(float* xout, float* x, REUPtr w, uint16_t n, uint16_t d) {
+    matmul_prepare(x, n);
+    matmul_rows(xout, x, w, row_size(n), n, d);
+}
+
+// dequantize a row of n weights (e.g. token embedding) into a float vector, a tile at a time
+void dequantize_row(float* o, REUPtr w, uint16_t n) {
+    for (uint16_t c = 0; c < n; c += MATMUL_TILE) {
+        uint8_t len = n - c < MATMUL_TILE ? n - c : MATMUL_TILE;
+        tile_fetch(wifbuf, w, n, c, len);
+        int8_t *wq = (int8_t*)wifbuf;
+        float *ws = (float*)(wq + (Q4 ? len / 2 : len));
+        for (uint8_t j = 0; j < len; j++) {
+            uint8_t g = j / MODEL_GROUP_SIZE;
+            if (LNS) {
+                uint8_t m = wq[j] & 0x7f;
+                float v = (float)(((uint16_t)lns_hi[m] << 8) | lns_lo[m]) * ws[g];
+                o[j] = wq[j] < 0 ? -v : v;
+            } else if (Q4) {
+                uint8_t k = j % MODEL_GROUP_SIZE;
+                if (k == 0) {
+                    uint8_t glen = len - j < MODEL_GROUP_SIZE ? len - j : MODEL_GROUP_SIZE;
+                    q4_unpack((uint8_t*)wq + j / 2, glen / 2);
+                }
+                o[j] = q4buf[k] * ws[g];
+            } else {
+                o[j] = wq[j] * ws[g];
+            }
+        }
+        o += len;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// classifier with bounds, see write_cls_bound() in generate-model-files.py
+// every row w of wcls has an int8 copy q with its scale s and two error factors in REU; with x quantized
+// to int8 as t * p + f
+//   w.x <= s * t * (q.p) + c * |f| + e * |x|
+// so that cheap integer dot products tell which rows can't matter
+
+// upper bounds of all logits into xout, x is local, bound is remote; returns the row with the highest bound
+uint16_t cls_bounds(float* xout, float* x, REUPtr bound) {
+    const uint16_t n = MODEL_DIM;
+    int8_t *p = xqmem;
+    float t = quantize_group(p, x, n);
+    float fnorm = 0.0;
+    float xnorm = 0.0;
+    for (uint16_t j = 0; j < n; j++) {
+        float f = x[j] - t * p[j];
+        fnorm += f * f;
+        xnorm += x[j] * x[j];
+    }
+    fnorm = sqrt(fnorm);
+    xnorm = sqrt(xnorm);
+
+    uint16_t best = 0;
+    for (uint16_t i = 0; i < MODEL_VOCAB_SIZE; i++) {
+        REU_getf(bound, wifbuf, MODEL_ROWSIZE_CLS_BOUND);
+        bound += MODEL_ROWSIZE_CLS_BOUND;
+        int8_t *q = (int8_t*)wifbuf;
+        float *sce = (float*)(q + n);
+        int32_t ival = 0;
+        for (uint16_t c = 0; c < n; c += MATMUL_TILE) {
+            ival += i8_dot(q + c, p + c, n - c < MATMUL_TILE ? n - c : MATMUL_TILE);
+        }
+        xout[i] = sce[0] * t * (float)ival + sce[1] * fnorm + sce[2] * xnorm;
+        if (xout[i] > xout[best]) { best = i; }
+    }
+    // x for the exact rows
+    matmul_prepare(x, n);
+    return best;
+}
+
+// exact logit of row i of w (dim,vocab_size), x was given to cls_bounds()
+float cls_row(float* x, REUPtr w, uint16_t i) {
+    REUPtr row = w + (uint32_t)i * MODEL_ROWSIZE_DIM;
+    float val = 0.0;
+    for (uint16_t c = 0; c < MODEL_DIM; c += MATMUL_TILE) {
+        uint8_t len = MODEL_DIM - c < MATMUL_TILE ? MODEL_DIM - c : MATMUL_TILE;
+        if (len < MODEL_DIM) {
+            tile_prepare(x + c, len);
+        }
+        tile_fetch(wifbuf, row, MODEL_DIM, c, len);
+        val = row_dot(wifbuf, len, val);
+    }
+    return val;
+}
+
+// logits for greedy sampling, only the largest one (the first of equal ones) is sure to be exact
+// xout is local, x is local, w is remote wcls, bound its remote int8 copy
+// the row with the highest bound goes first, it's most likely the winner, then all rows that can still beat it;
+// the others keep their bound
+void matmul_greedy(float* xout, float* x, REUPtr w, REUPtr bound) {
+    uint16_t best = cls_bounds(xout, x, bound);
+    float max = cls_row(x, w, best);
+    xout[best] = max;
+    for (uint16_t i = 0; i < MODEL_VOCAB_SIZE; i++) {
+        if (i != best && xout[i] >= max) {
+            xout[i] = cls_row(x, w, i);
+            if (xout[i] > max) { max = xout[i]; }
+        }
+    }
+}
+
+#if MODEL_SHORTLIST_MARGIN > 0
+uint16_t shortlist[MODEL_VOCAB_SIZE]; // tokens of the logits computed by matmul_shortlist()
+
+// approximate logits for sampling: only the rows whose bound comes within margin of the largest logit,
+// the others would get a probability below exp(-margin/temperature) of the most likely token
+// xout is local, x is local, w is remote wcls, bound its remote int8 copy
+// returns the number of logits in xout, they are for the tokens in shortlist
+uint16_t matmul_shortlist(float* xout, float* x, REUPtr w, REUPtr bound, float margin) {
+    uint16_t best = cls_bounds(xout, x, bound);
+    float max = cls_row(x, w, best);
+    xout[best] = max;
+    uint16_t n = 0;
+    for (uint16_t i = 0; i < MODEL_VOCAB_SIZE; i++) {
+        if (xout[i] >= max - margin) {
+            // n <= i, bounds still to be checked are not overwritten
+            xout[n] = (i == best) ? xout[i] : cls_row(x, w, i);
+            if (xout[n] > max) { max = xout[n]; }
+            shortlist[n] = i;
+            n++;
+        }
+    }
+    return n;
+}
+#endif
+
+// cos/sin values of the relative positional encoding at pos, for one head, from the table in REU
+void rope_table(float* fcir_table, uint16_t pos)
+{
+    if (MODEL_KV_WINDOW > 0 && pos >= MODEL_SEQ_LEN) {
+        // streaming mode past seq_len: the angles of pos % seq_len rotated by those of the multiple of seq_len below pos
+        float fcoarse[MODEL_HEAD_SIZE];
+        REU_getf(MODEL_ROPE + (uint32_t)(pos % MODEL_SEQ_LEN) * (MODEL_HEAD_SIZE * sizeof(float)), fcir_table, MODEL_HEAD_SIZE * sizeof(float));
+        REU_getf(MODEL_ROPE_COARSE + (uint32_t)(pos / MODEL_SEQ_LEN) * (MODEL_HEAD_SIZE * sizeof(float)), fcoarse, MODEL_HEAD_SIZE * sizeof(float));
+        for (uint8_t h = 0; h < MODEL_HEAD_SIZE; h+=2) {
+            float fcr = fcir_table[h];
+            float fci = fcir_table[h+1];
+            fcir_table[h] = fcr * fcoarse[h] - fci * fcoarse[h+1];
+            fcir_table[h+1] = fcr * fcoarse[h+1] + fci * fcoarse[h];
         }
-        xo++;
+    } else {
+        REU_getf(MODEL_ROPE + (uint32_t)pos * (MODEL_HEAD_SIZE * sizeof(float)), fcir_table, MODEL_HEAD_SIZE * sizeof(float));
     }
 }
-    
-void rope(uint8_t dim, RunState64 *s, uint8_t head_size, uint16_t pos, uint8_t kv_dim)
+
+// complex-valued rotate every head of vec (n,) by the angles in fcir_table
+void rope_rotate(float* vec, uint16_t n, float* fcir_table)
+{
+    uint8_t table_idx = 0;
+    for (uint16_t i = 0; i < n; i += 2)
+    {
+        float fcr = fcir_table[table_idx];
+        float fci = fcir_table[table_idx + 1];
+        float v0 = vec[0];
+        float v1 = vec[1];
+        vec[0] = v0 * fcr - v1 * fci;
+        vec[1] = v0 * fci + v1 * fcr;
+        vec += 2;
+        table_idx += 2;
+        if (table_idx == MODEL_HEAD_SIZE) { table_idx = 0; }
+    }
+}
+
+void rope(RunState64 *s, uint16_t pos)
 {
     static uint16_t last_pos = -1;
     // RoPE relative positional encoding: complex-valued rotate q and k in each head
-    REUPtr vecq = s->q; // the vector to rotate (query or key)
-    REUPtr veck = s->k; // the vector to rotate (query or key)
-    float vi[2];
-    float vo[2];
-    float val = pos;
+    // q and k are local
     float *fcir_table = s->fcir; // cache space
 
     if (last_pos != pos) {
         last_pos = pos;
         // cache the sin/cos values for the relative positional encoding
-        for (uint8_t h = 0; h < head_size; h+=2) {
-            fcir_table[h] = my_cos(val);
-            fcir_table[h+1] = my_sin(val);
-            val /= 10.0;
+        rope_table(fcir_table, pos);
+    }
+
+    rope_rotate(s->q, MODEL_DIM, fcir_table);
+    rope_rotate(s->k, MODEL_KV_DIM, fcir_table);
+}
+
+// ----------------------------------------------------------------------------
+// kv cache, float32 or int8 with one scale per head vector (KV_Q8)
+
+// kv cache slot of a position; in streaming mode the sinks keep the first slots
+// and the positions after them go round the window
+uint16_t kv_slot(uint16_t pos) {
+    if (MODEL_KV_WINDOW > 0 && pos >= MODEL_KV_SLOTS) {
+        return MODEL_KV_SINKS + (pos - MODEL_KV_SINKS) % MODEL_KV_WINDOW;
+    }
+    return pos;
+}
+
+// store key or value vector x (kv_dim,) of one position into the kv cache
+void kv_store(REUPtr cache, uint16_t pos, float* x) {
+    if (KV_QUANTIZED) {
+        uint8_t *kv = kvbuf;
+        for (uint8_t h = 0; h < MODEL_N_KV_HEADS; h++) {
+            *(float*)(kv + MODEL_HEAD_SIZE) = quantize_group((int8_t*)kv, x, MODEL_HEAD_SIZE);
+            kv += MODEL_KV_HEAD;
+            x += MODEL_HEAD_SIZE;
         }
+        x = (float*)kvbuf;
     }
+    REU_putf(cache + (uint32_t)kv_slot(pos) * MODEL_KV_POS, x, MODEL_KV_POS);
+}
 
-    uint8_t table_idx = 0;
-    for (uint8_t i = 0; i < dim; i += 2)
-    {
-        float fcr = fcir_table[table_idx];
-        float fci = fcir_table[table_idx + 1];
-        uint8_t rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-        for (uint8_t v = 0; v < rotn; v++)
-        {
-            REUPtr vec = v == 0 ? vecq : veck; // the vector to rotate (query or key)
-            REU_getf(vec, &vi[0], 2 * sizeof(float));
-            vo[0] = vi[0] * fcr - vi[1] * fci;
-            vo[1] = vi[0] * fci + vi[1] * fcr;
-            REU_putf(vec, &vo[0], 2 * sizeof(float));
-        }
-        vecq += 2 * sizeof(float);
-        veck += 2 * sizeof(float);
-        table_idx += 2;
-        if (table_idx == head_size) { table_idx = 0; }
+// dot product of an int8 key vector of one head, followed by its scale, with a quantized query head
+float kv_dot(int8_t* kq, int8_t* hq, float qscale) {
+    int32_t ival = i8_dot(kq, hq, MODEL_HEAD_SIZE);
+    return ((float)ival) * (*(float*)(kq + MODEL_HEAD_SIZE)) * qscale;
+}
+
+// prepare the MODEL_KV_MUL consecutive query heads q of a kv head for the score dot products
+void attn_query(float* q) {
+    if (KV_QUANTIZED) {
+        for (uint8_t j = 0; j < MODEL_KV_MUL; j++) {
+            hqscale[j] = quantize_group(hqbuf + j * MODEL_HEAD_SIZE, q + j * MODEL_HEAD_SIZE, MODEL_HEAD_SIZE);
+        }
+    } else {
+        fdot_prepare(q, MODEL_KV_MUL * MODEL_HEAD_SIZE);
     }
 }
 
-void attn(Config64 *p, RunState64 *s, uint8_t head_size, uint16_t pos, uint32_t loff, uint8_t kv_dim, uint8_t kv_mul)
+// grouped-query attention: the MODEL_KV_MUL query heads that share a kv head are served
+// together, so every key and value vector is fetched from REU only once
+// in streaming mode, once pos is past the kv cache, all slots are used and the sinks
+// are scored with s->qs, the query as if it were in the last slot
+void attn(RunState64 *s, uint16_t pos, const LayerWeights64* lw)
 {
-    // multihead attention. iterate over all heads
-    for (uint8_t h = 0; h < p->n_heads; h++)
+    float head_sqrt = sqrt(MODEL_HEAD_SIZE);
+    uint8_t wrapped = MODEL_KV_WINDOW > 0 && pos >= MODEL_KV_SLOTS;
+    uint16_t slots = wrapped ? MODEL_KV_SLOTS : pos + 1;
+    // online softmax: running max of the scores and sum of the weights, scaled to that max
+    float max_val[MODEL_KV_MUL];
+    float sum[MODEL_KV_MUL];
+    float att[MODEL_KV_MUL]; // attention weights at the current timestep
+    // iterate over all kv heads
+    for (uint8_t g = 0; g < MODEL_N_KV_HEADS; g++)
     {
-        // get the query vector for this head
-        REUPtr q = s->q + ((uint32_t)h * head_size) * sizeof(float); // XXX64: q is remote
-        // attention scores for this head
-        REUPtr att = s->att + ((uint32_t)h * p->seq_len) * sizeof(float); // XXX64: att is remote
+        // the query vectors of this group are local, consecutive and shared by all timesteps
+        uint16_t qoffs = g * (MODEL_KV_MUL * MODEL_HEAD_SIZE);
+        attn_query((wrapped ? s->qs : s->q) + qoffs);
+        // weighted sums of the values, store into xb
+        float *xb = s->xb + g * (MODEL_KV_MUL * MODEL_HEAD_SIZE);
+        memset(xb, 0, MODEL_KV_MUL * MODEL_HEAD_SIZE * sizeof(float));
         // iterate over all timesteps, including the current one
-        REUPtr atti = att;
-        REUPtr k = s->key_cache + ((uint32_t)loff + (uint32_t)(h / kv_mul) * head_size) * sizeof(float); // XXX64: key_cache is remote
-        for (uint16_t t = 0; t <= pos; t++)
+        REUPtr k = lw->key_cache + g * MODEL_KV_HEAD; // XXX64: key_cache is remote
+        REUPtr v = lw->value_cache + g * MODEL_KV_HEAD;
+        for (uint16_t t = 0; t < slots; t++)
         {
-            // get the key vector for this head and at this timestep
-            // calculate the attention score as the dot product of q and k
-            float score = 0.0;
-            float *h1 = h1buff;
-            float *h2 = h2buff;
-            REU_getf(q, h1, head_size*sizeof(float));
-            REU_getf(k, h2, head_size*sizeof(float));
-            for (uint8_t i = 0; i < head_size; i++)
+            if (wrapped && t == MODEL_KV_SINKS) {
+                // past the sinks, the window is scored with the query at its own position
+                attn_query(s->q + qoffs);
+            }
+            // get the key vector for this kv head and at this timestep
+            REU_getf(k, h2buff, MODEL_KV_HEAD);
+            k += MODEL_KV_POS; // move to the next key vector
+            float *xbj = xb;
+            for (uint8_t j = 0; j < MODEL_KV_MUL; j++)
             {
-                score += (*h1) * (*h2);
-                h1++;
-                h2++;
+                // calculate the attention score as the dot product of q and k
+                float score = KV_QUANTIZED ? kv_dot((int8_t*)h2buff, hqbuf + j * MODEL_HEAD_SIZE, hqscale[j])
+                                           : fdot_from(h2buff, j * MODEL_HEAD_SIZE, MODEL_HEAD_SIZE);
+                if (!MODEL_FOLDED) { score /= head_sqrt; }
+                // attention weight for this timestep, relative to the max so far
+                float a;
+                if (t == 0 || score > max_val[j]) {
+                    if (t > 0) {
+                        // new max, rescale everything accumulated so far
+                        float c = my_exp(max_val[j] - score);
+                        sum[j] *= c;
+                        for (uint8_t i = 0; i < MODEL_HEAD_SIZE; i++) {
+                            xbj[i] *= c;
+                        }
+                    } else {
+                        sum[j] = 0.0;
+                    }
+                    max_val[j] = score;
+                    a = 1.0;
+                } else {
+                    a = my_exp(score - max_val[j]);
+                }
+                sum[j] += a;
+                att[j] = a;
+                xbj += MODEL_HEAD_SIZE;
             }
-            score /= sqrt(head_size);
-            // save the score to the attention buffer
-            REU_putf(atti, &score, sizeof(float)); // XXX buffer
-            atti += sizeof(float);
-            k += kv_dim*sizeof(float); // move to the next key vector
-        }
-
-        // softmax the scores to get attention weights, from 0..pos inclusively
-        softmax(att, pos + 1);
-
-        // weighted sum of the values, store back into xb
-        float *xb = s->xb + h * head_size;
-        memset(xb, 0, head_size * sizeof(float));
-        atti = att;
-        // get the value vector for this head and at this timestep
-        REUPtr v = s->value_cache + ((uint32_t)loff + (uint32_t)(h / kv_mul) * head_size) * sizeof(float);
-        for (uint16_t t = 0; t <= pos; t++)
-        {
-            // get the attention weight for this timestep
-            float a;
-            REU_getf(atti, &a, sizeof(float));
-            atti += sizeof(float);
- 
-            // accumulate the weighted value into xb
-            float *h1 = h1buff;
-            REU_getf(v, h1, head_size*sizeof(float));
-            for (uint8_t i = 0; i < head_size; i++)
+
+            // accumulate the weighted value into xb of every query head
+            REU_getf(v, h2buff, MODEL_KV_HEAD);
+            v += MODEL_KV_POS; // move to the next value vector
+            xbj = xb;
+            for (uint8_t j = 0; j < MODEL_KV_MUL; j++)
             {
-                xb[i] += a * (*h1);
-                h1++;
+                float a = att[j];
+                if (KV_QUANTIZED) {
+                    int8_t *vq = (int8_t*)h2buff;
+                    a *= *(float*)(vq + MODEL_HEAD_SIZE); // value scale
+                    for (uint8_t i = 0; i < MODEL_HEAD_SIZE; i++)
+                    {
+                        (*xbj) += a * (*vq);
+                        vq++;
+                        xbj++;
+                    }
+                } else {
+                    float *h2 = h2buff;
+                    for (uint8_t i = 0; i < MODEL_HEAD_SIZE; i++)
+                    {
+                        (*xbj) += a * (*h2);
+                        h2++;
+                        xbj++;
+                    }
+                }
+            }
+        }
+        // normalize, this completes the softmax
+        for (uint8_t j = 0; j < MODEL_KV_MUL; j++) {
+            for (uint8_t i = 0; i < MODEL_HEAD_SIZE; i++) {
+                xb[i] /= sum[j];
             }
-            v += kv_dim * sizeof(float); // move to the next value vector
+            xb += MODEL_HEAD_SIZE;
         }
     }
 }
 
+// copy the token embedding into x
+void embed(act_t* x, TransformerWeights64* w, uint16_t token) {
+    REUPtr content_row = w->token_embedding_table + (uint32_t)token * MODEL_ROWSIZE_DIM;
+    float *xf = (float*)x;
+    if (GROUPED) {
+        dequantize_row(xf, content_row, MODEL_DIM);
+    } else {
+        REU_getf(content_row, xf, MODEL_ROWSIZE_DIM);
+        if (BF16) { bf16_widen(xf, MODEL_DIM); }
+    }
+    act_from_floats(xf, MODEL_DIM);
+}
+
+// SwiGLU non-linearity of the matching outputs of w1 and w3
+// the float32 dot product kernel skips zero inputs, so with MODEL_FFN_EPSILON > 0 (approximate)
+// the outputs closer to zero than that are flushed to zero and save their multiplications in w2,
+// the rows of w2 are still fetched whole and the int8 kernels gain nothing
+#if MODEL_FIXED_POINT
+act_t swiglu(float h1f, float h3) {
+    act_t h1 = act_from_float(h1f);
+    // σ(h1) in Q15.16, interpolated in the Q1.15 table, 0 and 1 outside of -8..8
+    if (h1 <= -8 * ACT_ONE) { return 0; }
+    act_t sig = ACT_ONE;
+    if (h1 < 8 * ACT_ONE) {
+        uint32_t t = h1 + 8 * ACT_ONE;
+        uint8_t i = (uint8_t)(t >> 12);
+        uint8_t f = (uint8_t)(t >> 4);
+        int16_t s0 = sigmoid_q15[i];
+        sig = ((int32_t)s0 << 1) + (((int32_t)(sigmoid_q15[i+1] - s0) * f) >> 7);
+    }
+    act_t val = act_mul(act_mul(h1, sig), act_from_float(h3));
+    if (MODEL_FFN_EPSILON > 0.0 && val < (act_t)(MODEL_FFN_EPSILON * ACT_ONE) && val > -(act_t)(MODEL_FFN_EPSILON * ACT_ONE)) { val = 0; }
+    return val;
+}
+#else
+float swiglu(float h1, float h3) {
+    // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+    h1 *= (1.0 / (1.0 + my_exp(-h1)));
+    // elementwise multiply with w3(x)
+    h1 *= h3;
+    if (MODEL_FFN_EPSILON > 0.0 && fabs(h1) < MODEL_FFN_EPSILON) { h1 = 0.0; }
+    return h1;
+}
+#endif
+
+// fused ffn up-projection: hb = silu(w1 @ x) * (w3 @ x)
+// x is prepared once for both matrices and matching rows of w1 and w3 are fetched together
+void ffn(act_t* hb, act_t* x, REUPtr w1, REUPtr w3) {
+    float *w3row = (float*)((uint8_t*)wifbuf + MODEL_ROWSIZE_DIM);
+    float *xf = act_to_floats(x, MODEL_DIM);
+    if (MODEL_DIM > MATMUL_TILE) {
+        // rows in tiles, all of w1 and then all of w3, the outputs of w1 wait in hb
+        float *h1 = (float*)hb;
+        matmul_rows(h1, xf, w1, MODEL_ROWSIZE_FFN, MODEL_DIM, MODEL_HIDDEN_DIM);
+        matmul_rows(h3buf, xf, FFN_INTERLEAVE ? w1 + MODEL_ROWSIZE_DIM : w3, MODEL_ROWSIZE_FFN, MODEL_DIM, MODEL_HIDDEN_DIM);
+        for (uint16_t i = 0; i < MODEL_HIDDEN_DIM; i++) {
+            hb[i] = swiglu(h1[i], h3buf[i]);
+        }
+        return;
+    }
+    matmul_prepare(xf, MODEL_DIM);
+    for (uint16_t i = 0; i < MODEL_HIDDEN_DIM; i++) {
+        if (FFN_INTERLEAVE) {
+            REU_getf(w1, wifbuf, 2 * MODEL_ROWSIZE_DIM);
+        } else {
+            REU_getf(w1, wifbuf, MODEL_ROWSIZE_DIM);
+            REU_getf(w3, w3row, MODEL_ROWSIZE_DIM);
+            w3 += MODEL_ROWSIZE_DIM;
+        }
+        w1 += MODEL_ROWSIZE_FFN;
+        float h1 = row_dot(wifbuf, MODEL_DIM, 0.0);
+        hb[i] = swiglu(h1, row_dot(w3row, MODEL_DIM, 0.0));
+    }
+}
+
+// q, k and v of layer 0 for this token, precomputed by generate-model-files.py
+void layer0_qkv(RunState64* s, uint16_t token) {
+    REUPtr row = MODEL_LAYER0_QKV + (uint32_t)token * ((MODEL_DIM + 2 * MODEL_KV_DIM) * sizeof(float));
+    REU_getf(row, s->q, MODEL_DIM * sizeof(float));
+    row += MODEL_DIM * sizeof(float);
+    REU_getf(row, s->k, MODEL_KV_DIM * sizeof(float));
+    row += MODEL_KV_DIM * sizeof(float);
+    REU_getf(row, s->v, MODEL_KV_DIM * sizeof(float));
+}
+
 char ui_statusbuf[40];
 
-// assumption: n_heads, dim, hidden_dim are <256
+// dim and hidden_dim can be larger than a tile of the matmuls, n_heads and head_size are below 256
 float* forward(Transformer* transformer, uint16_t token, uint16_t pos) {
 
-    // a few convenience variables
-    Config64* p = transformer->config;
+    // a few convenience variables, the shape of the model is known at compile time
     TransformerWeights64* w = &transformer->weights; // XXX64:all are remote
     RunState64* s = &transformer->state;
-    float *x = s->x; // XXX64: x, s->x local
-    uint8_t dim = p->dim;
-    uint8_t kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    uint8_t kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
-    uint8_t hidden_dim =  p->hidden_dim;
-    uint8_t head_size = dim / p->n_heads;
+    act_t *x = s->x; // XXX64: x, s->x local
+    const uint16_t dim = MODEL_DIM;
+    const uint16_t kv_dim = MODEL_KV_DIM;
+    const uint16_t hidden_dim = MODEL_HIDDEN_DIM;
 
     // copy the token embedding into x
     // XXX64: token_embedding_table is remote, x is local
-    REUPtr content_row = w->token_embedding_table + ((uint32_t)token * dim)*sizeof(float);
-    REU_getf(content_row, x, dim*sizeof(float));
+    embed(x, w, token);
 
     // forward all the layers
-    for(uint8_t l = 0; l < p->n_layers; l++) {
-
-        // attention rmsnorm
-        // XXX64: xb is local, x is local, weight is remote
-        sprintf(ui_statusbuf, "layer %d rmsnorm1 [%d]", l+1, dim);
-        ui_settopstatus(ui_statusbuf);
-        rmsnorm(s->xb, x, w->rms_att_weight + ((uint32_t)l*dim)*sizeof(float), dim);
+    for(uint8_t l = 0; l < MODEL_N_LAYERS; l++) {
+        const LayerWeights64* lw = &model_layers[l]; // REU addresses for this layer
 
-        // key and value point to the kv cache
-        uint32_t loff = (uint32_t)l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-        s->k = s->key_cache + (loff + (uint32_t)pos * kv_dim)*sizeof(float);
-        s->v = s->value_cache + (loff + (uint32_t)pos * kv_dim)*sizeof(float);
+        if (l == 0 && MODEL_LAYER0_TABLE) {
+            // layer 0 q/k/v depend only on the token
+            layer0_qkv(s, token);
+        } else {
+            // attention rmsnorm
+            // XXX64: xb is local, x is local, weight is remote
+            sprintf(ui_statusbuf, "layer %d rmsnorm1 [%d]", l+1, dim);
+            ui_settopstatus(ui_statusbuf);
+            rmsnorm(s->xn, x, lw->rms_att_weight, dim);
 
-        // qkv matmuls for this position
-        sprintf(ui_statusbuf, "layer %d matrix1 [%d*%d]", l+1, dim, dim);
-        ui_settopstatus(ui_statusbuf);
-        matmul(s->q, s->xb, w->wq + ((uint32_t)l*dim*dim)*sizeof(float), dim, dim);
-        sprintf(ui_statusbuf, "layer %d matrix2 [%d*%d]", l+1, dim, kv_dim);
-        ui_settopstatus(ui_statusbuf);
-        matmul(s->k, s->xb, w->wk + ((uint32_t)l*dim*kv_dim)*sizeof(float), dim, kv_dim);
-        sprintf(ui_statusbuf, "layer %d matrix3 [%d*%d]", l+1, dim, kv_dim);
-        ui_settopstatus(ui_statusbuf);
-        matmul(s->v, s->xb, w->wv + ((uint32_t)l*dim*kv_dim)*sizeof(float), dim, kv_dim);
+            // qkv matmuls for this position, all share xb as the operand and stay local
+            sprintf(ui_statusbuf, "layer %d matrix1-3 [%d*%d]", l+1, dim, dim+2*kv_dim);
+            ui_settopstatus(ui_statusbuf);
+            float *xn = act_to_floats(s->xn, dim);
+            matmul_prepare(xn, dim);
+            matmul_rows(s->q, xn, lw->wq, MODEL_ROWSIZE_DIM, dim, dim);
+            matmul_rows(s->k, xn, lw->wk, MODEL_ROWSIZE_DIM, dim, kv_dim);
+            matmul_rows(s->v, xn, lw->wv, MODEL_ROWSIZE_DIM, dim, kv_dim);
+        }
 
         sprintf(ui_statusbuf, "layer %d rope [%d]", l+1, dim);
         ui_settopstatus(ui_statusbuf);
-        rope(dim, s, head_size, pos, kv_dim); // modifies s->q and s->k in place
+        if (MODEL_KV_WINDOW > 0 && pos >= MODEL_KV_SLOTS) {
+            // the sinks see the query at the last slot, so their distance stays within the cache
+            memcpy(s->qs, s->q, dim * sizeof(float));
+            rope_rotate(s->qs, dim, fcir_sink);
+        }
+        rope(s, pos); // modifies s->q and s->k in place
+
+        // key and value go into the kv cache, one transfer each
+        kv_store(lw->key_cache, pos, s->k);
+        kv_store(lw->value_cache, pos, s->v);
 
         sprintf(ui_statusbuf, "layer %d attention [%d]", l+1, kv_dim);
         ui_settopstatus(ui_statusbuf);
-        attn(p, s, head_size, pos, loff, kv_dim, kv_mul);
+        attn(s, pos, lw);
 
         // final matmul to get the output of the attention
         sprintf(ui_statusbuf, "layer %d matrix4 [%d*%d]", l+1, dim, dim);
         ui_settopstatus(ui_statusbuf);
-        matmul_l(s->xb2, s->xb, w->wo + ((uint32_t)l*dim*dim)*sizeof(float), dim, dim);
+        matmul_l(s->xb2, s->xb, lw->wo, dim, dim);
 
         // residual connection back into x
-        for (uint8_t i = 0; i < dim; i++) {
-            x[i] += s->xb2[i];
-        }
+        act_add(x, s->xb2, dim);
 
         // ffn rmsnorm
         // XXX64: xb is local, x is local, weight is remote
         sprintf(ui_statusbuf, "layer %d rmsnorm2 [%d]", l+1, dim);
         ui_settopstatus(ui_statusbuf);
-        rmsnorm(s->xb, x, w->rms_ffn_weight + ((uint32_t)l*dim)*sizeof(float), dim);
+        rmsnorm(s->xn, x, lw->rms_ffn_weight, dim);
 
         // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-        // first calculate self.w1(x) and self.w3(x)
-        sprintf(ui_statusbuf, "layer %d matrix6 [%d*%d]", l+1, dim, hidden_dim);
-        ui_settopstatus(ui_statusbuf);
-        matmul_l(s->hb, s->xb, w->w1 + ((uint32_t)l*dim*hidden_dim)*sizeof(float), dim, hidden_dim);
-        sprintf(ui_statusbuf, "layer %d matrix7 [%d*%d]", l+1, dim, hidden_dim);
-        ui_settopstatus(ui_statusbuf);
-        matmul_l(s->hb2, s->xb, w->w3 + ((uint32_t)l*dim*hidden_dim)*sizeof(float), dim, hidden_dim);
-
-        // SwiGLU non-linearity
-        sprintf(ui_statusbuf, "layer %d swiglu [%d]", l+1, hidden_dim);
+        // self.w1(x), self.w3(x) and SwiGLU non-linearity in one pass
+        sprintf(ui_statusbuf, "layer %d matrix6-7 [%d*%d]", l+1, dim, 2*hidden_dim);
         ui_settopstatus(ui_statusbuf);
-        for (uint8_t i = 0; i < hidden_dim; i++) {
-            float val = s->hb[i];
-            // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-            val *= (1.0 / (1.0 + my_exp(-val)));
-            // elementwise multiply with w3(x)
-            val *= s->hb2[i];
-            s->hb[i] = val;
-        }
+        ffn(s->hb, s->xn, lw->w1, lw->w3);
 
         // final matmul to get the output of the ffn
         sprintf(ui_statusbuf, "layer %d matrix8 [%d*%d]", l+1, hidden_dim, dim);
         ui_settopstatus(ui_statusbuf);
-        matmul_l(s->xb, s->hb, w->w2 + ((uint32_t)l*dim*hidden_dim)*sizeof(float), hidden_dim, dim);
+        matmul_l(s->xb, act_to_floats(s->hb, hidden_dim), lw->w2, hidden_dim, dim);
 
         // residual connection
-        for (uint8_t i = 0; i < dim; i++) {
-            x[i] += s->xb[i];
-        }
+        act_add(x, s->xb, dim);
     }
 
+    return classify(transformer);
+}
+
+// logits from x after the last layer
+float* classify(Transformer* transformer) {
+    TransformerWeights64* w = &transformer->weights;
+    RunState64* s = &transformer->state;
+    const uint16_t dim = MODEL_DIM;
+
     // final rmsnorm
     // XXX64: x is local, x is local, weight is remote
     sprintf(ui_statusbuf, "layer - rmsnorm3 [%d]", dim);
     ui_settopstatus(ui_statusbuf);
-    rmsnorm(x, x, w->rms_final_weight, dim);
+    rmsnorm(s->x, s->x, w->rms_final_weight, dim);
+    float *x = act_to_floats(s->x, dim); // x is no longer needed as an activation
 
     // classifier into logits
-    sprintf(ui_statusbuf, "layer - matrix9 [%d*%d]", dim, p->vocab_size);
+    sprintf(ui_statusbuf, "layer - matrix9 [%d*%d]", dim, MODEL_VOCAB_SIZE);
     ui_settopstatus(ui_statusbuf);
-    matmul_ll(s->logits, x, w->wcls, dim, p->vocab_size);
+    s->n_logits = MODEL_VOCAB_SIZE;
+    if (MODEL_CLS_BOUND && s->greedy) {
+        matmul_greedy(s->logits, x, w->wcls, w->wcls_bound);
+#if MODEL_SHORTLIST_MARGIN > 0
+    } else if (s->shortlist_margin > 0.0) {
+        s->n_logits = matmul_shortlist(s->logits, x, w->wcls, w->wcls_bound, s->shortlist_margin);
+        s->logit_tokens = shortlist;
+#endif
+    } else {
+        matmul_ll(s->logits, x, w->wcls, dim, MODEL_VOCAB_SIZE);
+    }
     return s->logits;
 }
+
+// ----------------------------------------------------------------------------
+// batched prompt prefill
+
+float pfdot1[PREFILL_BATCH]; // dot products of one row of W with all vectors of the batch
+float pfdot3[PREFILL_BATCH]; // same, for the matching row of w3 in the fused ffn
+
+// size in bytes of one of the T vectors in local memory, quantized ones are int8 values (LNS codes and
+// signs) followed by the group scales
+uint16_t batch_size(uint16_t n) {
+    return GROUPED ? (LNS ? 2 * n : n) + GROUPS(n) * sizeof(float) : n * sizeof(float);
+}
+
+// point xqbuf, xgbuf and xsbuf to the tile at column c of vector t
+void batch_select(uint8_t t, uint16_t n, uint16_t c) {
+    uint8_t *v = (uint8_t*)pfbuf + t * batch_size(n);
+    xqbuf = (int8_t*)(v + c);
+    xgbuf = v + n + c;
+    xsbuf = (float*)(v + (LNS ? 2 * n : n)) + c / MODEL_GROUP_SIZE;
+}
+
+// fetch T vectors of X (T,n) into local memory, quantized tile by tile for quantized weights
+// vectors are xstride bytes apart
+void batch_prepare(REUPtr x, uint16_t xstride, uint16_t n, uint8_t T) {
+    int8_t *xq = xqbuf;
+    uint8_t *xg = xgbuf;
+    float *xs = xsbuf;
+    for (uint8_t t = 0; t < T; t++) {
+        if (GROUPED) {
+            for (uint16_t c = 0; c < n; c += MATMUL_TILE) {
+                uint8_t len = n - c < MATMUL_TILE ? n - c : MATMUL_TILE;
+                REU_getf(x + c * sizeof(float), wifbuf, len * sizeof(float));
+                batch_select(t, n, c);
+                tile_prepare(wifbuf, len);
+            }
+        } else {
+            REU_getf(x, pfbuf + t * n, n*sizeof(float));
+        }
+        x += xstride;
+    }
+    xqbuf = xq;
+    xgbuf = xg;
+    xsbuf = xs;
+}
+
+// dot products of a local tile of a row of W (columns c..c+len-1) with all T vectors from batch_prepare(),
+// added to out past the first tile
+void batch_dot(float* out, float* w, uint16_t n, uint16_t c, uint8_t len, uint8_t T) {
+    int8_t *xq = xqbuf;
+    uint8_t *xg = xgbuf;
+    float *xs = xsbuf;
+    // the row is the shared operand now, unpack it once
+    if (!GROUPED) { fdot_prepare_row((uint8_t*)w, BF16 ? sizeof(uint16_t) : sizeof(float), len); }
+    for (uint8_t t = 0; t < T; t++) {
+        float acc = c > 0 ? out[t] : 0.0;
+        if (GROUPED) {
+            batch_select(t, n, c);
+            out[t] = row_dot(w, len, acc);
+        } else {
+            out[t] = fdot(pfbuf + t * n + c, len, acc);
+        }
+    }
+    xqbuf = xq;
+    xgbuf = xg;
+    xsbuf = xs;
+}
+
+// Y (T,d) = W (d,n) @ X (T,n), X and Y are remote, vectors are xstride/ystride bytes apart
+// all T vectors are kept in local memory and every row of W is fetched only once, a tile at a time
+void matmul_batch(REUPtr y, uint16_t ystride, REUPtr x, uint16_t xstride, REUPtr w, uint16_t n, uint16_t d, uint8_t T) {
+    uint16_t rowsize = row_size(n);
+    batch_prepare(x, xstride, n, T);
+    for (uint16_t i = 0; i < d; i++) {
+        for (uint16_t c = 0; c < n; c += MATMUL_TILE) {
+            uint8_t len = n - c < MATMUL_TILE ? n - c : MATMUL_TILE;
+            tile_fetch(wifbuf, w, n, c, len);
+            batch_dot(pfdot1, wifbuf, n, c, len, T);
+        }
+        w += rowsize;
+        REUPtr yt = y + i * sizeof(float);
+        for (uint8_t t = 0; t < T; t++) {
+            REU_putf(yt, &pfdot1[t], sizeof(float));
+            yt += ystride;
+        }
+    }
+}
+
+// batched version of ffn(), Y (T,hidden_dim) = silu(w1 @ X) * (w3 @ X), X (T,dim)
+void ffn_batch(REUPtr y, uint16_t ystride, REUPtr x, uint16_t xstride, REUPtr w1, REUPtr w3, uint8_t T) {
+    float *w3row = (float*)((uint8_t*)wifbuf + ROW_BYTES(TILE_DIM));
+    batch_prepare(x, xstride, MODEL_DIM, T);
+    for (uint16_t i = 0; i < MODEL_HIDDEN_DIM; i++) {
+        for (uint16_t c = 0; c < MODEL_DIM; c += MATMUL_TILE) {
+            uint8_t len = MODEL_DIM - c < MATMUL_TILE ? MODEL_DIM - c : MATMUL_TILE;
+            if (FFN_INTERLEAVE && len == MODEL_DIM) {
+                REU_getf(w1, wifbuf, 2 * MODEL_ROWSIZE_DIM);
+            } else {
+                tile_fetch(wifbuf, w1, MODEL_DIM, c, len);
+                tile_fetch(w3row, FFN_INTERLEAVE ? w1 + MODEL_ROWSIZE_DIM : w3, MODEL_DIM, c, len);
+            }
+            batch_dot(pfdot1, wifbuf, MODEL_DIM, c, len, T);
+            batch_dot(pfdot3, w3row, MODEL_DIM, c, len, T);
+        }
+        w1 += MODEL_ROWSIZE_FFN;
+        w3 += MODEL_ROWSIZE_DIM;
+        REUPtr yt = y + i * sizeof(float);
+        for (uint8_t t = 0; t < T; t++) {
+            // stored as float32 for the next matmul_batch()
+            float val = act_to_float(swiglu(pfdot1[t], pfdot3[t]));
+            REU_putf(yt, &val, sizeof(float));
+            yt += ystride;
+        }
+    }
+}
+
+// run prompt tokens through the model to fill the KV cache for positions start..n-1
+// tokens go in batches of PREFILL_BATCH, one layer at a time for the whole batch, so every weight row
+// is fetched once per batch; there are no logits and the last layer stops after its keys and values
+void prefill(Transformer* transformer, int16_t* tokens, uint16_t start, uint16_t n) {
+
+    // a few convenience variables, the shape of the model is known at compile time
+    TransformerWeights64* w = &transformer->weights;
+    RunState64* s = &transformer->state;
+    act_t *x = s->x;
+    const uint16_t dim = MODEL_DIM;
+    const uint16_t kv_dim = MODEL_KV_DIM;
+    const uint16_t hidden_dim = MODEL_HIDDEN_DIM;
+    const uint16_t vsize = MODEL_DIM * sizeof(float);
+    const uint16_t hsize = MODEL_HIDDEN_DIM * sizeof(float);
+    const uint16_t kvsize = MODEL_KV_DIM * sizeof(float);
+
+    for (uint16_t pos0 = start; pos0 < n; pos0 += PREFILL_BATCH) {
+        uint8_t T = (n - pos0 < PREFILL_BATCH) ? n - pos0 : PREFILL_BATCH;
+
+        // token embeddings of the whole batch
+        for (uint8_t t = 0; t < T; t++) {
+            embed(x, w, tokens[pos0 + t]);
+            REU_putf(s->pf_x + (uint32_t)t * vsize, (float*)x, vsize);
+        }
+
+        for (uint8_t l = 0; l < MODEL_N_LAYERS; l++) {
+            const LayerWeights64* lw = &model_layers[l]; // REU addresses for this layer
+
+            // float32 keys and values go straight into the kv cache, positions of the batch are consecutive
+            // int8 ones are quantized after rope, until then they wait in pf_hb which is free here (PREFILL_HB fits both)
+            REUPtr k = KV_QUANTIZED ? s->pf_hb : lw->key_cache + (uint32_t)pos0 * MODEL_KV_POS;
+            REUPtr v = KV_QUANTIZED ? s->pf_hb + PREFILL_BATCH * kvsize : lw->value_cache + (uint32_t)pos0 * MODEL_KV_POS;
+
+            if (l == 0 && MODEL_LAYER0_TABLE) {
+                // layer 0 q/k/v depend only on the token
+                sprintf(ui_statusbuf, "layer %d rope [%d*%d]", l+1, T, dim);
+                ui_settopstatus(ui_statusbuf);
+                for (uint8_t t = 0; t < T; t++) {
+                    layer0_qkv(s, tokens[pos0 + t]);
+                    rope(s, pos0 + t);
+                    REU_putf(s->pf_q + (uint32_t)t * vsize, s->q, vsize);
+                    kv_store(lw->key_cache, pos0 + t, s->k);
+                    kv_store(lw->value_cache, pos0 + t, s->v);
+                }
+            } else {
+                // attention rmsnorm
+                sprintf(ui_statusbuf, "layer %d rmsnorm1 [%d*%d]", l+1, T, dim);
+                ui_settopstatus(ui_statusbuf);
+                // the matmul inputs in pf_xb are float32, also with fixed-point activations
+                for (uint8_t t = 0; t < T; t++) {
+                    REU_getf(s->pf_x + (uint32_t)t * vsize, (float*)x, vsize);
+                    rmsnorm(s->xn, x, lw->rms_att_weight, dim);
+                    REU_putf(s->pf_xb + (uint32_t)t * vsize, act_to_floats(s->xn, dim), vsize);
+                }
+
+                // qkv matmuls for all positions of the batch
+                sprintf(ui_statusbuf, "layer %d matrix1 [%d*%d*%d]", l+1, T, dim, dim);
+                ui_settopstatus(ui_statusbuf);
+                matmul_batch(s->pf_q, vsize, s->pf_xb, vsize, lw->wq, dim, dim, T);
+                sprintf(ui_statusbuf, "layer %d matrix2 [%d*%d*%d]", l+1, T, dim, kv_dim);
+                ui_settopstatus(ui_statusbuf);
+                matmul_batch(k, kvsize, s->pf_xb, vsize, lw->wk, dim, kv_dim, T);
+                sprintf(ui_statusbuf, "layer %d matrix3 [%d*%d*%d]", l+1, T, dim, kv_dim);
+                ui_settopstatus(ui_statusbuf);
+                matmul_batch(v, kvsize, s->pf_xb, vsize, lw->wv, dim, kv_dim, T);
+
+                sprintf(ui_statusbuf, "layer %d rope [%d*%d]", l+1, T, dim);
+                ui_settopstatus(ui_statusbuf);
+                for (uint8_t t = 0; t < T; t++) {
+                    REU_getf(s->pf_q + (uint32_t)t * vsize, s->q, vsize);
+                    REU_getf(k + (uint32_t)t * kvsize, s->k, kvsize);
+                    rope(s, pos0 + t);
+                    REU_putf(s->pf_q + (uint32_t)t * vsize, s->q, vsize);
+                    kv_store(lw->key_cache, pos0 + t, s->k);
+                    if (KV_QUANTIZED) {
+                        REU_getf(v + (uint32_t)t * kvsize, s->v, kvsize);
+                        kv_store(lw->value_cache, pos0 + t, s->v);
+                    }
+                }
+            }
+
+            // nothing else from the last layer is needed without logits
+            if (l == MODEL_N_LAYERS - 1) { break; }
+
+            sprintf(ui_statusbuf, "layer %d attention [%d*%d]", l+1, T, kv_dim);
+            ui_settopstatus(ui_statusbuf);
+            for (uint8_t t = 0; t < T; t++) {
+                REU_getf(s->pf_q + (uint32_t)t * vsize, s->q, vsize);
+                attn(s, pos0 + t, lw);
+                REU_putf(s->pf_xb + (uint32_t)t * vsize, s->xb, vsize);
+            }
+
+            // final matmul to get the output of the attention, pf_q is free now
+            sprintf(ui_statusbuf, "layer %d matrix4 [%d*%d*%d]", l+1, T, dim, dim);
+            ui_settopstatus(ui_statusbuf);
+            matmul_batch(s->pf_q, vsize, s->pf_xb, vsize, lw->wo, dim, dim, T);
+
+            // residual connection back into x and ffn rmsnorm
+            sprintf(ui_statusbuf, "layer %d rmsnorm2 [%d*%d]", l+1, T, dim);
+            ui_settopstatus(ui_statusbuf);
+            for (uint8_t t = 0; t < T; t++) {
+                REU_getf(s->pf_x + (uint32_t)t * vsize, (float*)x, vsize);
+                REU_getf(s->pf_q + (uint32_t)t * vsize, s->xb2, vsize);
+                act_add(x, s->xb2, dim);
+                REU_putf(s->pf_x + (uint32_t)t * vsize, (float*)x, vsize);
+                rmsnorm(s->xn, x, lw->rms_ffn_weight, dim);
+                REU_putf(s->pf_xb + (uint32_t)t * vsize, act_to_floats(s->xn, dim), vsize);
+            }
+
+            // ffn
+            sprintf(ui_statusbuf, "layer %d matrix6-7 [%d*%d*%d]", l+1, T, dim, 2*hidden_dim);
+            ui_settopstatus(ui_statusbuf);
+            ffn_batch(s->pf_hb, hsize, s->pf_xb, vsize, lw->w1, lw->w3, T);
+
+            sprintf(ui_statusbuf, "layer %d matrix8 [%d*%d*%d]", l+1, T, hidden_dim, dim);
+            ui_settopstatus(ui_statusbuf);
+            matmul_batch(s->pf_q, vsize, s->pf_hb, hsize, lw->w2, hidden_dim, dim, T);
+
+            // residual connection
+            for (uint8_t t = 0; t < T; t++) {
+                REU_getf(s->pf_x + (uint32_t)t * vsize, (float*)x, vsize);
+                REU_getf(s->pf_q + (uint32_t)t * vsize, s->xb, vsize);
+                act_add(x, s->xb, dim);
+                REU_putf(s->pf_x + (uint32_t)t * vsize, (float*)x, vsize);
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// baked prompt prefixes, see generate-model-files.py --prefixes
+
+// copy keys and values of positions start..len-1 of a baked prefix into the kv cache,
+// and x at its last position into s->x; REU to REU goes through pfbuf
+void prefix_restore(Transformer* transformer, const BakedPrefix64* prefix, uint16_t start) {
+    RunState64* s = &transformer->state;
+    REUPtr src = prefix->state;
+    REU_getf(src, (float*)s->x, MODEL_DIM * sizeof(float));
+    src += MODEL_DIM * sizeof(float);
+    uint32_t size = (uint32_t)prefix->len * MODEL_KV_POS; // one layer of keys or values
+    uint32_t skip = (uint32_t)start * MODEL_KV_POS;
+    for (uint8_t l = 0; l < MODEL_N_LAYERS; l++) {
+        for (uint8_t c = 0; c < 2; c++) {
+            REUPtr dst = (c == 0 ? model_layers[l].key_cache : model_layers[l].value_cache) + skip;
+            REUPtr from = src + skip;
+            uint32_t left = size - skip;
+            while (left > 0) {
+                uint16_t len = left < sizeof(pfbuf) ? left : sizeof(pfbuf);
+                REU_getf(from, pfbuf, len);
+                REU_putf(dst, pfbuf, len);
+                from += len;
+                dst += len;
+                left -= len;
+            }
+            src += size;
+        }
+    }
+}
@@ -12,11 +12,14 @@
 
 // init
 void nnet_init(Transformer* transformer);
-
-// sampler
-void softmax(REUPtr x, uint16_t size);
+void qsq_init(void);
+void lns_init(void);
+void q4_init(void);
 
 // generate
 float* forward(Transformer* transformer, uint16_t token, uint16_t pos);
+void prefill(Transformer* transformer, int16_t* tokens, uint16_t start, uint16_t n);
+float* classify(Transformer* transformer);
+void prefix_restore(Transformer* transformer, const BakedPrefix64* prefix, uint16_t start);
 
 #endif // NNET_H
\ No newline at end of file
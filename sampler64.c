@@ -161,7 +161,7 @@ float random_f32(uint32_t *state) { // random float32 in [0,1)
     return (random_u32(state) >> 8) / 16777216.0;
 }
 
-// same softmax as in nnet64.c, but with local buffer
+// softmax over local buffer
 void softmax_local(float* x, uint16_t size) {
         // find max value (for numerical stability)
         float max_val = x[0];
@@ -186,26 +186,26 @@ void softmax_local(float* x, uint16_t size) {
         }
 }
 
-uint16_t sample(Sampler* sampler, float* logits) {
-    // sample the token given the logits and some hyperparameters
+uint16_t sample(Sampler* sampler, float* logits, uint16_t n) {
+    // sample the token given the first n logits (vocab_size, or a shortlist) and some hyperparameters
     uint16_t next;
     if (sampler->temperature == 0.0) {
         // greedy argmax sampling: take the token with the highest probability
-        next = sample_argmax(logits, sampler->vocab_size);
+        next = sample_argmax(logits, n);
     } else {
         // apply the temperature to the logits
-        for (uint16_t q=0; q<sampler->vocab_size; q++) { logits[q] /= sampler->temperature; }
+        for (uint16_t q=0; q<n; q++) { logits[q] /= sampler->temperature; }
         // apply softmax to the logits to get the probabilities for next token
-        softmax_local(logits, sampler->vocab_size); // XXX64: logits are local but softmax works on remote, need local softmax version
+        softmax_local(logits, n);
         // flip a (float) coin (this is our source of entropy for sampling)
         float coin = random_f32(&sampler->rng_state);
         // we sample from this distribution to get the next token
         if (sampler->topp <= 0 || sampler->topp >= 1) {
             // simply sample from the predicted probability distribution
-            next = sample_mult(logits, sampler->vocab_size, coin);
+            next = sample_mult(logits, n, coin);
         } else {
             // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
+            next = sample_topp(logits, n, sampler->topp, sampler->probindex, coin);
         }
     }
     return next;
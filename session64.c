@@ -0,0 +1,109 @@
+/* Inference for Llama-2 Transformer model in pure C */
+
+// C64 port by Maciej 'YTM/Elysium' Witkowiak, 2025
+
+#include <c64/kernalio.h>
+
+#include "session64.h"
+
+// ----------------------------------------------------------------------------
+// session snapshot
+//
+// file layout: Session64 header, kv_len tokens of the kv cache history, then for each layer
+// the used kv cache slots (keys, then values) exactly as they are in REU
+// the kv cache is much larger than C64 RAM, so it goes to disk through a small staging buffer
+
+#define SESSION_FNUM 2
+
+char session_buf[256];
+
+// copy size bytes from REU to the open session file
+uint8_t session_write_reu(REUPtr src, uint32_t size) {
+    while (size > 0) {
+        uint16_t len = size < sizeof(session_buf) ? size : sizeof(session_buf);
+        REU_getf(src, (float*)session_buf, len);
+        if (krnio_write(SESSION_FNUM, session_buf, len) != len) { return 0; }
+        src += len;
+        size -= len;
+    }
+    return 1;
+}
+
+// copy size bytes from the open session file to REU
+uint8_t session_read_reu(REUPtr dst, uint32_t size) {
+    while (size > 0) {
+        uint16_t len = size < sizeof(session_buf) ? size : sizeof(session_buf);
+        if (krnio_read(SESSION_FNUM, session_buf, len) != len) { return 0; }
+        REU_putf(dst, (float*)session_buf, len);
+        dst += len;
+        size -= len;
+    }
+    return 1;
+}
+
+uint8_t session_save(Transformer* transformer, Sampler* sampler, int16_t token, uint16_t pos, uint16_t steps) {
+    RunState64* s = &transformer->state;
+
+    Session64 session;
+    session.magic = SESSION_MAGIC;
+    session.checksum = MODEL_CHECKSUM;
+    session.reu_end = MODEL_REU_END;
+    session.kv_pos = MODEL_KV_POS;
+    session.kv_slots = MODEL_KV_SLOTS;
+    session.pos = pos;
+    session.token = token;
+    session.steps = steps;
+    session.kv_len = s->kv_len;
+    session.temperature = sampler->temperature;
+    session.topp = sampler->topp;
+    session.rng_state = sampler->rng_state;
+
+    // only the slots filled so far, all of them once the streaming kv cache went round
+    uint16_t slots = pos < MODEL_KV_SLOTS ? pos : MODEL_KV_SLOTS;
+    uint32_t size = (uint32_t)slots * MODEL_KV_POS;
+
+    krnio_setnam(p"@0:llama2 session,s,w");
+    if (!krnio_open(SESSION_FNUM, SESSION_DEVICE, SESSION_FNUM)) { return 1; }
+    uint8_t ok = krnio_write(SESSION_FNUM, (char*)&session, sizeof(Session64)) == sizeof(Session64);
+    ok = ok && session_write_reu(s->kv_tokens, session.kv_len * sizeof(int16_t));
+    for (uint8_t l = 0; ok && l < MODEL_N_LAYERS; l++) {
+        ok = session_write_reu(model_layers[l].key_cache, size) && session_write_reu(model_layers[l].value_cache, size);
+    }
+    krnio_close(SESSION_FNUM);
+    return ok ? 0 : 2;
+}
+
+uint8_t session_load(Transformer* transformer, Sampler* sampler, Session64* session) {
+    RunState64* s = &transformer->state;
+
+    krnio_setnam(p"llama2 session,s,r");
+    if (!krnio_open(SESSION_FNUM, SESSION_DEVICE, SESSION_FNUM)) { return 1; }
+    uint8_t ok = krnio_read(SESSION_FNUM, (char*)session, sizeof(Session64)) == sizeof(Session64);
+    // a session fits only the model (weights, options and kv cache layout) it was saved with
+    ok = ok && session->magic == SESSION_MAGIC && session->checksum == MODEL_CHECKSUM && session->reu_end == MODEL_REU_END;
+    ok = ok && session->kv_pos == MODEL_KV_POS && session->kv_slots == MODEL_KV_SLOTS;
+    // and a damaged file must not stream more tokens into REU than kv_tokens holds
+    ok = ok && session->steps <= (MODEL_KV_WINDOW > 0 ? STREAMING_MAXSTEPS : MODEL_SEQ_LEN) && session->pos <= session->steps;
+    ok = ok && session->kv_len <= MODEL_KV_SLOTS && session->token >= 0 && session->token < MODEL_VOCAB_SIZE;
+    if (!ok) {
+        krnio_close(SESSION_FNUM);
+        return 2;
+    }
+
+    uint16_t slots = session->pos < MODEL_KV_SLOTS ? session->pos : MODEL_KV_SLOTS;
+    uint32_t size = (uint32_t)slots * MODEL_KV_POS;
+
+    ok = session_read_reu(s->kv_tokens, session->kv_len * sizeof(int16_t));
+    for (uint8_t l = 0; ok && l < MODEL_N_LAYERS; l++) {
+        ok = session_read_reu(model_layers[l].key_cache, size) && session_read_reu(model_layers[l].value_cache, size);
+    }
+    krnio_close(SESSION_FNUM);
+    // a half-loaded kv cache is no good for prefix reuse either
+    s->kv_len = ok ? session->kv_len : 0;
+    if (!ok) { return 3; }
+
+    sampler->temperature = session->temperature;
+    sampler->topp = session->topp;
+    sampler->rng_state = session->rng_state;
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* Inference for Llama-2 Transformer model in pure C */
+
+// C64 port by Maciej 'YTM/Elysium' Witkowiak, 2025
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdint.h>
+
+#include "transformer64.h"
+#include "sampler64.h"
+
+// ----------------------------------------------------------------------------
+// session snapshot on disk: kv cache, token history, sampler and position,
+// so that a long generation can be stopped and resumed later
+
+#define SESSION_MAGIC 0x35363253 // 'S265' in little-endian uint32_t, changes with the file layout
+#define SESSION_DEVICE 8
+
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;   // MODEL_CHECKSUM of the model files the session was saved with
+    uint32_t reu_end;    // MODEL_REU_END, MODEL_KV_POS and MODEL_KV_SLOTS of that model
+    uint16_t kv_pos;
+    uint16_t kv_slots;
+    uint16_t pos;        // position of token in the sequence
+    int16_t token;       // next token to forward, keys and values of 0..pos-1 are in the kv cache
+    uint16_t steps;
+    uint16_t kv_len;     // tokens in the kv cache token history
+    float temperature;
+    float topp;
+    uint32_t rng_state;
+} Session64;
+
+// both return 0 on success
+uint8_t session_save(Transformer* transformer, Sampler* sampler, int16_t token, uint16_t pos, uint16_t steps);
+uint8_t session_load(Transformer* transformer, Sampler* sampler, Session64* session);
+
+#endif // SESSION_H
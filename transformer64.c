@@ -58,24 +58,37 @@ void malloc_run_state(Transformer* t) {
     Config64* p = t->config;
 
     // we calloc instead of malloc to keep valgrind happy
-    uint32_t kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    s->x = calloc(p->dim, sizeof(float));
+    s->x = calloc(p->dim, sizeof(act_t));
     s->xb = calloc(p->dim, sizeof(float));
+    s->xn = (act_t*)s->xb;
     s->xb2 = calloc(p->dim, sizeof(float));
-    s->hb = calloc(p->hidden_dim, sizeof(float));
-    s->hb2 = calloc(p->hidden_dim, sizeof(float));
-//    s->q = calloc(p->dim, sizeof(float));
-    s->q = reu_base;
-    reu_base += p->dim * sizeof(float);
+    // hb also holds v, hidden_dim is larger than kv_dim in any llama model but not in every checkpoint
+    s->hb = calloc(MODEL_HIDDEN_DIM > MODEL_KV_DIM ? MODEL_HIDDEN_DIM : MODEL_KV_DIM, sizeof(act_t));
+    s->q = calloc(p->dim, sizeof(float));
+    if (MODEL_KV_WINDOW > 0) {
+        s->qs = calloc(p->dim, sizeof(float));
+    }
+    // k and v are needed only until they are stored in the kv cache, before xb2 and hb are used
+    s->k = s->xb2;
+    s->v = (float*)s->hb;
 //    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
-    s->key_cache = reu_base;
-    reu_base += p->n_layers * p->seq_len * kv_dim * sizeof(float);
+    s->key_cache = MODEL_KEY_CACHE; // right after the weights
 //    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(float));
-    s->value_cache = reu_base;
-    reu_base += p->n_layers * p->seq_len * kv_dim * sizeof(float);
-//    s->att = calloc(p->n_heads * p->seq_len, sizeof(float));
-    s->att = reu_base;
-    reu_base += p->n_heads * p->seq_len * sizeof(float);
+    s->value_cache = MODEL_VALUE_CACHE;
+    reu_base = MODEL_VALUE_CACHE + MODEL_N_LAYERS * MODEL_KV_LAYER;
+    // tokens in the kv cache, so that the next prompt can reuse their keys and values
+    s->kv_tokens = reu_base;
+    reu_base += MODEL_KV_SLOTS * sizeof(int16_t);
+    s->kv_len = 0;
+    // scratch for prefill()
+    s->pf_x = reu_base;
+    reu_base += PREFILL_BATCH * p->dim * sizeof(float);
+    s->pf_xb = reu_base;
+    reu_base += PREFILL_BATCH * p->dim * sizeof(float);
+    s->pf_q = reu_base;
+    reu_base += PREFILL_BATCH * p->dim * sizeof(float);
+    s->pf_hb = reu_base;
+    reu_base += PREFILL_BATCH * PREFILL_HB * sizeof(float);
     s->logits = calloc(p->vocab_size, sizeof(float));
     // cache for sin/cos used in rope()
     s->fcir = calloc(p->dim / p->n_heads, sizeof(float));
@@ -83,39 +96,24 @@ void malloc_run_state(Transformer* t) {
 
 void memory_map_weights(Transformer* t) {
     TransformerWeights64* w = &t->weights;
-    Config64* p = t->config;
-    uint16_t shared_weights = p->shared_weights;
-    REUPtr ptr = reu_base;
-
-    uint32_t head_size = p->dim / p->n_heads;
-    // make sure the multiplications below are done in 32 bit at least
-    uint32_t n_layers = p->n_layers;
-    w->token_embedding_table = ptr;
-    ptr += sizeof(float) * (uint32_t)p->vocab_size * p->dim;
-    w->rms_att_weight = ptr;
-    ptr += sizeof(float) * n_layers * p->dim;
-    w->wq = ptr;
-    ptr += sizeof(float) * n_layers * p->dim * (p->n_heads * head_size);
-    w->wk = ptr;
-    ptr += sizeof(float) * n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wv = ptr;
-    ptr += sizeof(float) * n_layers * p->dim * (p->n_kv_heads * head_size);
-    w->wo = ptr;
-    ptr += sizeof(float) * n_layers * (p->n_heads * head_size) * p->dim;
-    w->rms_ffn_weight = ptr;
-    ptr += sizeof(float) * n_layers * p->dim;
-    w->w1 = ptr;
-    ptr += sizeof(float) * n_layers * p->dim * p->hidden_dim;
-    w->w2 = ptr;
-    ptr += sizeof(float) * n_layers * p->hidden_dim * p->dim;
-    w->w3 = ptr;
-    ptr += sizeof(float) * n_layers * p->dim * p->hidden_dim;
-    w->rms_final_weight = ptr;
-    ptr += sizeof(float) * p->dim;
-    ptr += sizeof(float) * p->seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
-    ptr += sizeof(float) * p->seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
-    w->wcls = shared_weights ? w->token_embedding_table : ptr;
-    reu_base = ptr; // first free byte after weights (must match weights.reu length + initial offset)
+
+    // the layout of weights.reu is known at compile time, see model64.h
+    w->token_embedding_table = MODEL_TOKEN_EMBEDDING_TABLE;
+    w->rms_att_weight = MODEL_RMS_ATT_WEIGHT;
+    w->wq = MODEL_WQ;
+    w->wk = MODEL_WK;
+    w->wv = MODEL_WV;
+    w->wo = MODEL_WO;
+    w->rms_ffn_weight = MODEL_RMS_FFN_WEIGHT;
+    w->w1 = MODEL_W1;
+    w->w2 = MODEL_W2;
+    w->w3 = MODEL_W3; // right after w1 rows for FFN_INTERLEAVED
+    w->rms_final_weight = MODEL_RMS_FINAL_WEIGHT;
+    w->rope = MODEL_ROPE; // followed by MODEL_ROPE_COARSE rows in streaming mode
+    w->wcls = MODEL_WCLS; // same as token_embedding_table for shared weights
+    w->layer0_qkv = MODEL_LAYER0_QKV;
+    w->wcls_bound = MODEL_WCLS_BOUND;
+    reu_base = MODEL_REU_END; // first free byte after weights (must match weights.reu length + initial offset)
 }
 
 void load_transformer(Transformer *t) {
@@ -132,18 +130,36 @@ void load_transformer(Transformer *t) {
         char ch = getch(); // wait for keypress
         exit(1);
     }
-    REU_getf((REUPtr)0x080000, (float*)&tmp, sizeof(uint32_t)); // 512KB offset
-    if (tmp == SIGNATURE) { e++; }; // wraparound at 512KB
-    REU_getf((REUPtr)0x100000, (float*)&tmp, sizeof(uint32_t)); // 1MB offset
-    if (tmp == SIGNATURE) { e++; }; // wraparound at 1MB
-    if (e>0) {
-        printf(p"need at least 2mb reu\n");
-        char ch = getch(); // wait for keypress
-        exit(1);
-    }
 
     // ok, continue with loading the model
     memory_map_weights(t);
     // allocate the RunState buffers
     malloc_run_state(t);
+
+    // weights, kv cache and prefill scratch end at reu_base, up to 16MB for the larger models
+    REUPtr need = 0x200000;
+    while (need < reu_base) { need <<= 1; }
+    for (REUPtr size = 0x080000; size < need; size <<= 1) {
+        REU_getf(size, (float*)&tmp, sizeof(uint32_t));
+        if (tmp == SIGNATURE) { e++; }; // wraparound, REU is smaller than that
+    }
+    if (e>0) {
+        printf(p"need at least %dmb reu\n", (uint16_t)(need >> 20));
+        char ch = getch(); // wait for keypress
+        exit(1);
+    }
+
+#if MODEL_EXP_TABLE
+    exp_table_init();
+#endif
+#if MODEL_FIXED_POINT
+    sigmoid_table_init(); // after the exp tables
+#endif
+    qsq_init();
+    if (MODEL_WEIGHTS_FORMAT == WEIGHTS_LNS) {
+        lns_init();
+    }
+    if (MODEL_WEIGHTS_FORMAT == WEIGHTS_Q4) {
+        q4_init();
+    }
 }
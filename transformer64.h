@@ -12,6 +12,21 @@
 
 typedef uint32_t REUPtr;
 
+// weights_format, written to config.bin by generate-model-files.py --quantize
+#define WEIGHTS_F32 0 // float32, unchanged from the checkpoint
+#define WEIGHTS_Q8  1 // int8 rows, each followed by float scales, one per group_size weights
+#define WEIGHTS_BF16 2 // bfloat16, the upper half of float32 (rounded), rms weights stay float32
+#define WEIGHTS_LNS  3 // sign and 7-bit log2 magnitude rows, each followed by float scales like WEIGHTS_Q8
+#define WEIGHTS_Q4   4 // 4-bit rows, two weights in a byte, each followed by float scales like WEIGHTS_Q8
+
+// ffn_layout, written to config.bin by generate-model-files.py --ffn-layout
+#define FFN_SEPARATE    0 // w1 and w3 as in the checkpoint
+#define FFN_INTERLEAVED 1 // w1 and w3 rows alternate, both are fetched in one go
+
+// kv_format, written to config.bin by generate-model-files.py --kv-cache
+#define KV_F32 0 // float32 keys and values
+#define KV_Q8  1 // int8 keys and values, each head vector followed by its float scale
+
 typedef struct {
     uint16_t dim; // transformer dimension
     uint16_t hidden_dim; // for ffn layers
@@ -21,9 +36,19 @@ typedef struct {
     uint16_t vocab_size; // vocabulary size, usually 256 (byte-level)
     uint16_t seq_len; // max sequence length
     uint16_t shared_weights;
+    uint16_t weights_format; // WEIGHTS_F32, WEIGHTS_Q8, WEIGHTS_BF16, WEIGHTS_LNS or WEIGHTS_Q4
+    uint16_t group_size; // quantization group size, number of weights sharing one scale
+    uint16_t ffn_layout; // FFN_SEPARATE or FFN_INTERLEAVED
+    uint16_t layer0_table; // q/k/v of layer 0 precomputed for every token
+    uint16_t folded; // rmsnorm gains and 1/sqrt(head_size) are folded into the matrices that follow
+    uint16_t kv_format; // KV_F32 or KV_Q8
+    uint16_t kv_sinks; // streaming mode: first positions kept in the kv cache
+    uint16_t kv_window; // streaming mode: recent positions kept in the kv cache, 0 = off (at most seq_len positions)
+    uint16_t cls_bound; // int8 copy of wcls with error bounds, for the greedy and shortlist classifiers
+    uint16_t shortlist_margin; // sampling computes only the logits within this many temperatures of the largest, 0 = off (exact)
 } Config64;
 
-// this is all within REU, these are all float*
+// this is all within REU, these are all float* (rms weights are float*, the rest is int8 rows with scales for WEIGHTS_Q8 or bfloat16 for WEIGHTS_BF16, sign/log bytes with scales for WEIGHTS_LNS, 4-bit pairs with scales for WEIGHTS_Q4)
 typedef struct {
     // token embedding table
     REUPtr token_embedding_table;    // (vocab_size, dim)
@@ -41,30 +66,88 @@ typedef struct {
     REUPtr w3; // (layer, hidden_dim, dim)
     // final rmsnorm
     REUPtr rms_final_weight; // (dim,)
+    // RoPE cos/sin pairs for every position, in place of freq_cis_real/freq_cis_imag of the checkpoint
+    REUPtr rope; // (seq_len, head_size)
     // (optional) classifier weights for the logits, on the last layer
     REUPtr wcls;
+    // (optional) layer 0 q, k, v before RoPE, they depend only on the token
+    REUPtr layer0_qkv; // (vocab_size, dim + 2 * kv_dim)
+    // (optional) wcls rows as int8 followed by float scale and two error bound factors, for greedy and shortlist sampling
+    REUPtr wcls_bound; // (vocab_size, dim + 3 * sizeof(float)) bytes
 } TransformerWeights64;
 
+// REU addresses of the weights and the kv cache of one layer
+typedef struct {
+    REUPtr rms_att_weight;
+    REUPtr wq;
+    REUPtr wk;
+    REUPtr wv;
+    REUPtr wo;
+    REUPtr rms_ffn_weight;
+    REUPtr w1;
+    REUPtr w2;
+    REUPtr w3;
+    REUPtr key_cache; // (seq_len, kv_dim), int8 with a scale per head vector for KV_Q8
+    REUPtr value_cache; // (seq_len, kv_dim)
+} LayerWeights64;
+
+// a prompt prefix computed by generate-model-files.py --prefixes
+typedef struct {
+    uint16_t len; // number of tokens
+    uint16_t tokens; // index of the first token in model_prefix_tokens
+    REUPtr state; // x (dim,) at the last position, then keys and values (len, kv_dim) of every layer
+} BakedPrefix64;
+
+// model shape and REU layout as constants, generated by generate-model-files.py with config.bin and weights.reu
+#include "model64.h"
+
+// prompt tokens processed together by prefill(), fewer for larger models as their vectors are kept in C64 RAM
+#define PREFILL_BATCH (MODEL_HIDDEN_DIM <= 192 ? 8 : MODEL_HIDDEN_DIM <= 384 ? 4 : MODEL_HIDDEN_DIM <= 768 ? 2 : 1)
+
+// floats per prompt token in pf_hb: the ffn hidden vector, with the int8 kv cache also the float keys and values waiting for quantization
+#define PREFILL_HB (MODEL_KV_FORMAT == KV_Q8 && 2 * MODEL_KV_DIM > MODEL_HIDDEN_DIM ? 2 * MODEL_KV_DIM : MODEL_HIDDEN_DIM)
+
+// in streaming mode (kv_window > 0) generation can go on beyond seq_len
+#define STREAMING_MAXSTEPS 9999
+
+// activations x, hb and the normalized x: float32, or Q15.16 fixed-point with MODEL_FIXED_POINT
+#if MODEL_FIXED_POINT
+typedef int32_t act_t;
+#else
+typedef float act_t;
+#endif
+
 // big arrays from here are in REU
 typedef struct {
     // current wave of activations
-    float *x; // activation at current time stamp (dim,)
+    act_t *x; // activation at current time stamp (dim,)
     float *xb; // same, but inside a residual branch (dim,)
+    act_t *xn; // normalized x, shares memory with xb (dim,)
     float *xb2; // an additional buffer just for convenience (dim,)
-    float *hb; // buffer for hidden dimension in the ffn (hidden_dim,)
-    float *hb2; // buffer for hidden dimension in the ffn (hidden_dim,)
+    act_t *hb; // buffer for hidden dimension in the ffn (hidden_dim,)
     float *fcir; // buffer for sin/cos used in rope (dim/n_heads,)
-    REUPtr q; // query (dim,) in REU for single matmul function
-    REUPtr k; // key (dim,) points into key_cache
-    REUPtr v; // value (dim,) points into value_cache
-//    float *att; // buffer for scores/attention values (n_heads, seq_len)
-    REUPtr att; // buffer for scores/attention values (n_heads, seq_len)
+    float *q; // query (dim,)
+    float *qs; // query rotated to the last kv cache slot, for the attention sinks in streaming mode (dim,)
+    float *k; // key (kv_dim,) before it goes into key_cache, shares memory with xb2
+    float *v; // value (kv_dim,) before it goes into value_cache, shares memory with hb
     float *logits; // output logits
+    uint8_t greedy; // only the largest logit matters (temperature 0), the others may be upper bounds
+    float shortlist_margin; // sampling leaves out logits this much below the largest one, 0 = exact
+    uint16_t n_logits; // number of logits, fewer than vocab_size for a shortlist
+    uint16_t *logit_tokens; // their tokens then
     // kv cache
 //    float* key_cache;   // (layer, seq_len, dim)
 //    float* value_cache; // (layer, seq_len, dim)
     REUPtr key_cache;   // (layer, seq_len, dim)
     REUPtr value_cache; // (layer, seq_len, dim)
+    // tokens whose keys and values are in the kv cache, left from the previous run
+    REUPtr kv_tokens; // (seq_len,) int16_t
+    uint16_t kv_len; // number of valid positions from 0
+    // prefill scratch, one vector per prompt token in the batch
+    REUPtr pf_x; // (PREFILL_BATCH, dim) activations
+    REUPtr pf_xb; // (PREFILL_BATCH, dim) inside a residual branch
+    REUPtr pf_q; // (PREFILL_BATCH, dim) queries, later matmul outputs
+    REUPtr pf_hb; // (PREFILL_BATCH, PREFILL_HB) ffn hidden vectors, or keys and values
 } RunState64;
 
 typedef struct {
@@ -83,6 +83,7 @@ void ui_init(void) {
 float temperature = 0.0;    // 0.0 = greedy deterministic. 1.0 = original. don't set higher
 float topp = 0.9;           // top-p in nucleus sampling. 1.0 = off. 0.9 works well, but slower
 int steps = 60;            // number of steps to run for
+uint8_t ui_resume = 0;      // continue the session saved to disk instead of a new prompt
 
 void ui_render_temp_topp(void) {
     if (temperature < 0.0) temperature = 0.0;
@@ -147,8 +148,17 @@ void ui_startup_screen(Config64 *c) {
     gotoxy(20,10); textcolor(COLOR_YELLOW); printf("%d", c->n_kv_heads);
     gotoxy(2,11); textcolor(COLOR_GREEN); printf("max sequence len:");
     gotoxy(20,11); textcolor(COLOR_YELLOW); printf("%d", c->seq_len);
+    if (c->kv_window > 0) { printf(" (%d+%d ring)", c->kv_sinks, c->kv_window); }
     gotoxy(2,12); textcolor(COLOR_GREEN); printf("vocabulary size:");
     gotoxy(20,12); textcolor(COLOR_YELLOW); printf("%d", c->vocab_size);
+    gotoxy(2,13); textcolor(COLOR_GREEN); printf("weights / kv:");
+    gotoxy(20,13); textcolor(COLOR_YELLOW);
+    if (c->weights_format == WEIGHTS_Q8) { printf("int8/%d", c->group_size); }
+    else if (c->weights_format == WEIGHTS_BF16) { printf("bfloat16"); }
+    else if (c->weights_format == WEIGHTS_LNS) { printf("log8/%d", c->group_size); }
+    else if (c->weights_format == WEIGHTS_Q4) { printf("int4/%d", c->group_size); }
+    else { printf("float32"); }
+    printf(c->kv_format == KV_Q8 ? " / int8" : " / float32");
     textcolor(COLOR_LT_GREY);
     ui_quasi_frame(15,23, "PARAMETERS");
     textcolor(COLOR_GREEN);
@@ -161,20 +171,23 @@ void ui_startup_screen(Config64 *c) {
     gotoxy(27,18); printf("(:/;)");
     gotoxy(27,19); printf("(,/. or </>)");
     textcolor(COLOR_RED);
-    gotoxy(8,24); printf("press <return> to start");
+    gotoxy(4,24); printf("<return> to start, <r> to resume");
 
-    ui_render_steps(c->seq_len);
+    uint16_t maxsteps = c->kv_window > 0 ? STREAMING_MAXSTEPS : c->seq_len;
+    ui_render_steps(maxsteps);
     ui_render_temp_topp();
+    ui_resume = 0;
     while (1) {
         char ch = getch();
-        if (ch == ',') { steps--; ui_render_steps(c->seq_len); }
-        if (ch == '.') { steps++; ui_render_steps(c->seq_len); }
-        if (ch == '<') { steps-=10; ui_render_steps(c->seq_len); }
-        if (ch == '>') { steps+=10; ui_render_steps(c->seq_len); }
+        if (ch == ',') { steps--; ui_render_steps(maxsteps); }
+        if (ch == '.') { steps++; ui_render_steps(maxsteps); }
+        if (ch == '<') { steps-=10; ui_render_steps(maxsteps); }
+        if (ch == '>') { steps+=10; ui_render_steps(maxsteps); }
         if (ch == ':') { topp -= 0.1; ui_render_temp_topp(); }
         if (ch == ';') { topp += 0.1; ui_render_temp_topp(); }
         if (ch == '-') { temperature -= 0.1; ui_render_temp_topp(); }
         if (ch == '+') { temperature += 0.1; ui_render_temp_topp(); }
+        if (ch == 'r') { ui_resume = 1; break; }
         if (ch == PETSCII_RETURN || ch == 10 ) { break; }
     }
 }
@@ -205,12 +218,17 @@ void ui_inference_screen_init(void) {
     textcolor(COLOR_LT_GREY);
 }
 
+// sampling with shortlists computes only some of the logits, don't take that output for the exact one
+void ui_setapproximate(uint8_t approximate) {
+    ui_quasi_frame(UI_OUTPUT_TOP-1, UI_OUTPUT_TOP+UI_OUTPUT_HEIGHT, approximate ? "output (approximate)" : "output");
+}
+
 void ui_setcurrenttoken(uint16_t pos, uint16_t steps) {
-    char buf[8];
+    char buf[10];
     sprintf(buf, "%03d/%03d", pos, steps);
     char x = wherex();
     char y = wherey();
-    gotoxy(40-2-7,UI_OUTPUT_TOP-1);
+    gotoxy(40-2-strlen(buf),UI_OUTPUT_TOP-1);
     puts(buf);
     gotoxy(x, y);
     clock_display();